@@ -1,13 +1,40 @@
 #ifndef APM_H
 #define APM_H
 
+#ifdef __KERNEL__
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
+#ifdef __x86_64__
+#include <asm/cpufeature.h>
+#endif
+#else /* userspace build of the tests and benchmarks */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef APM_THREADS
+#include <pthread.h>
+#endif
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
 
+#include "fib_trace.h"
 #include "mem.h"
 
-/* LP64, X86_64, AMD64, AARCH64 */
+/* LP64 targets only. x86-64 gets its digit primitives from inline asm,
+ * along with the ADX kernels below; every other one, AArch64 included, from
+ * unsigned __int128 arithmetic, with the digit loops in plain C. Defining
+ * APM_GENERIC selects the portable code on x86-64 as well, to test it; CI
+ * also cross-builds it for AArch64 and runs the tests under qemu.
+ */
+#if defined(__x86_64__) && !defined(APM_GENERIC)
+#define APM_X86_64
+#elif !defined(__SIZEOF_INT128__)
+#error "apm.h needs a 64-bit target with unsigned __int128"
+#endif
+
 #define DIGIT_SIZE 8
 #define DIGIT_BITS 64U
 
@@ -16,25 +43,27 @@
 
 static inline uint64_t *enew(uint32_t size)
 {
+    trace_fib_alloc(size, false);
     return MALLOC(size * DIGIT_SIZE);
 }
 
 static inline uint64_t *new0(uint32_t size)
 {
-    return zero(enew(size), size);
+    uint64_t *u = enew(size);
+    return u ? zero(u, size) : NULL;
 }
 
 static inline uint64_t *resize(uint64_t *u, uint32_t size)
 {
-    if (u)
+    if (u) {
+        trace_fib_alloc(size, true);
         return REALLOC(u, size * DIGIT_SIZE);
+    }
     return enew(size);
 }
 
 #define APM_TMP_ALLOC(size) enew(size)
 #define APM_TMP_FREE(num) FREE(num)
-#define APM_TMP_COPY(num, size) \
-    memcpy(APM_TMP_ALLOC(size), (num), (size) *DIGIT_SIZE)
 
 /* Return real size of u[size] with leading zeros removed. */
 static inline uint32_t rsize(const uint64_t *u, uint32_t size)
@@ -109,9 +138,246 @@ uint64_t daddi(uint64_t *u, uint32_t size, uint64_t v)
     return ((u[0] += v) < v) ? inc(&u[1], size - 1) : 0;
 }
 
+#ifdef APM_X86_64
+#define APM_ADX
+#endif
+
+/* Whether the limb loops below hand their bulk to the x86-64 kernels that
+ * follow, which need MULX from BMI2 and ADCX/ADOX from ADX. The C loops
+ * remain the fallback and handle the digits left over by the kernels.
+ */
+static bool apm_adx;
+
+/* Use the ADX kernels if @adx and the CPU has them; return whether it
+ * does.
+ */
+static bool apm_init(bool adx)
+{
+#ifdef APM_ADX
+#ifdef __KERNEL__
+    adx = adx && boot_cpu_has(X86_FEATURE_ADX) &&
+          boot_cpu_has(X86_FEATURE_BMI2);
+#else
+    adx = adx && __builtin_cpu_supports("adx") &&
+          __builtin_cpu_supports("bmi2");
+#endif
+#else
+    adx = false;
+#endif
+    apm_adx = adx;
+    return adx;
+}
+
+#ifdef APM_ADX
+/* The kernels work on blocks of 4 digits, n of them, and return the carry
+ * out. Loop counters are stepped with DEC, which leaves CF alone, or with
+ * LEA and JRCXZ where OF has to survive as well.
+ */
+
+/* w[4n] = u[4n] + v[4n] */
+static uint64_t add_n_adx(const uint64_t *u,
+                          const uint64_t *v,
+                          uint32_t n,
+                          uint64_t *w)
+{
+    uint64_t cy = 0, t;
+    size_t blocks = n;
+    __asm__(
+        "clc\n\t"
+        "1:\n\t"
+        "mov (%[u]), %[t]\n\t"
+        "adc (%[v]), %[t]\n\t"
+        "mov %[t], (%[w])\n\t"
+        "mov 8(%[u]), %[t]\n\t"
+        "adc 8(%[v]), %[t]\n\t"
+        "mov %[t], 8(%[w])\n\t"
+        "mov 16(%[u]), %[t]\n\t"
+        "adc 16(%[v]), %[t]\n\t"
+        "mov %[t], 16(%[w])\n\t"
+        "mov 24(%[u]), %[t]\n\t"
+        "adc 24(%[v]), %[t]\n\t"
+        "mov %[t], 24(%[w])\n\t"
+        "lea 32(%[u]), %[u]\n\t"
+        "lea 32(%[v]), %[v]\n\t"
+        "lea 32(%[w]), %[w]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "adc $0, %[cy]"
+        : [u] "+r"(u), [v] "+r"(v), [w] "+r"(w), [n] "+r"(blocks),
+          [cy] "+r"(cy), [t] "=&r"(t)
+        :
+        : "cc", "memory");
+    return cy;
+}
+
+/* w[4n] = u[4n] - v[4n] */
+static uint64_t sub_n_adx(const uint64_t *u,
+                          const uint64_t *v,
+                          uint32_t n,
+                          uint64_t *w)
+{
+    uint64_t cy = 0, t;
+    size_t blocks = n;
+    __asm__(
+        "clc\n\t"
+        "1:\n\t"
+        "mov (%[u]), %[t]\n\t"
+        "sbb (%[v]), %[t]\n\t"
+        "mov %[t], (%[w])\n\t"
+        "mov 8(%[u]), %[t]\n\t"
+        "sbb 8(%[v]), %[t]\n\t"
+        "mov %[t], 8(%[w])\n\t"
+        "mov 16(%[u]), %[t]\n\t"
+        "sbb 16(%[v]), %[t]\n\t"
+        "mov %[t], 16(%[w])\n\t"
+        "mov 24(%[u]), %[t]\n\t"
+        "sbb 24(%[v]), %[t]\n\t"
+        "mov %[t], 24(%[w])\n\t"
+        "lea 32(%[u]), %[u]\n\t"
+        "lea 32(%[v]), %[v]\n\t"
+        "lea 32(%[w]), %[w]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "adc $0, %[cy]"
+        : [u] "+r"(u), [v] "+r"(v), [w] "+r"(w), [n] "+r"(blocks),
+          [cy] "+r"(cy), [t] "=&r"(t)
+        :
+        : "cc", "memory");
+    return cy;
+}
+
+/* w[4n] = u[4n] * v, with the high halves of the products added in along
+ * a single ADCX chain.
+ */
+static uint64_t dmul_adx(const uint64_t *u,
+                         uint32_t n,
+                         uint64_t v,
+                         uint64_t *w)
+{
+    uint64_t cy = 0, lo, hi;
+    size_t blocks = n;
+    __asm__(
+        "xor %k[lo], %k[lo]\n\t"
+        "1:\n\t"
+        "mulx (%[u]), %[lo], %[hi]\n\t"
+        "adcx %[cy], %[lo]\n\t"
+        "mov %[lo], (%[w])\n\t"
+        "mulx 8(%[u]), %[lo], %[cy]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "mov %[lo], 8(%[w])\n\t"
+        "mulx 16(%[u]), %[lo], %[hi]\n\t"
+        "adcx %[cy], %[lo]\n\t"
+        "mov %[lo], 16(%[w])\n\t"
+        "mulx 24(%[u]), %[lo], %[cy]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "mov %[lo], 24(%[w])\n\t"
+        "lea 32(%[u]), %[u]\n\t"
+        "lea 32(%[w]), %[w]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "adc $0, %[cy]"
+        : [u] "+r"(u), [w] "+r"(w), [n] "+r"(blocks), [cy] "+r"(cy),
+          [lo] "=&r"(lo), [hi] "=&r"(hi)
+        : "d"(v)
+        : "cc", "memory");
+    return cy;
+}
+
+/* w[4n] += u[4n] * v, adding the high halves along the ADCX (CF) chain and
+ * the digits of w along the ADOX (OF) chain.
+ */
+static uint64_t dmul_add_adx(const uint64_t *u,
+                             uint32_t n,
+                             uint64_t v,
+                             uint64_t *w)
+{
+    uint64_t cy = 0, lo, hi;
+    size_t blocks = n;
+    __asm__(
+        "xor %k[lo], %k[lo]\n\t"
+        "1:\n\t"
+        "mulx (%[u]), %[lo], %[hi]\n\t"
+        "adcx %[cy], %[lo]\n\t"
+        "adox (%[w]), %[lo]\n\t"
+        "mov %[lo], (%[w])\n\t"
+        "mulx 8(%[u]), %[lo], %[cy]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "adox 8(%[w]), %[lo]\n\t"
+        "mov %[lo], 8(%[w])\n\t"
+        "mulx 16(%[u]), %[lo], %[hi]\n\t"
+        "adcx %[cy], %[lo]\n\t"
+        "adox 16(%[w]), %[lo]\n\t"
+        "mov %[lo], 16(%[w])\n\t"
+        "mulx 24(%[u]), %[lo], %[cy]\n\t"
+        "adcx %[hi], %[lo]\n\t"
+        "adox 24(%[w]), %[lo]\n\t"
+        "mov %[lo], 24(%[w])\n\t"
+        "lea 32(%[u]), %[u]\n\t"
+        "lea 32(%[w]), %[w]\n\t"
+        "lea -1(%[n]), %[n]\n\t"
+        "jrcxz 2f\n\t"
+        "jmp 1b\n"
+        "2:\n\t"
+        "mov $0, %k[lo]\n\t"
+        "adcx %[lo], %[cy]\n\t"
+        "adox %[lo], %[cy]"
+        : [u] "+r"(u), [w] "+r"(w), [n] "+c"(blocks), [cy] "+r"(cy),
+          [lo] "=&r"(lo), [hi] "=&r"(hi)
+        : "d"(v)
+        : "cc", "memory");
+    return cy;
+}
+
+/* v[8n] += u[i]^2 * 2^(128i) for i < 4n */
+static uint64_t sqr_diag_adx(const uint64_t *u, uint32_t n, uint64_t *v)
+{
+    uint64_t cy = 0, lo, hi;
+    size_t blocks = n;
+    __asm__(
+        "clc\n\t"
+        "1:\n\t"
+        "mov (%[u]), %%rdx\n\t"
+        "mulx %%rdx, %[lo], %[hi]\n\t"
+        "adc %[lo], (%[v])\n\t"
+        "adc %[hi], 8(%[v])\n\t"
+        "mov 8(%[u]), %%rdx\n\t"
+        "mulx %%rdx, %[lo], %[hi]\n\t"
+        "adc %[lo], 16(%[v])\n\t"
+        "adc %[hi], 24(%[v])\n\t"
+        "mov 16(%[u]), %%rdx\n\t"
+        "mulx %%rdx, %[lo], %[hi]\n\t"
+        "adc %[lo], 32(%[v])\n\t"
+        "adc %[hi], 40(%[v])\n\t"
+        "mov 24(%[u]), %%rdx\n\t"
+        "mulx %%rdx, %[lo], %[hi]\n\t"
+        "adc %[lo], 48(%[v])\n\t"
+        "adc %[hi], 56(%[v])\n\t"
+        "lea 32(%[u]), %[u]\n\t"
+        "lea 64(%[v]), %[v]\n\t"
+        "dec %[n]\n\t"
+        "jnz 1b\n\t"
+        "adc $0, %[cy]"
+        : [u] "+r"(u), [v] "+r"(v), [n] "+r"(blocks), [cy] "+r"(cy),
+          [lo] "=&r"(lo), [hi] "=&r"(hi)
+        :
+        : "rdx", "cc", "memory");
+    return cy;
+}
+#endif /* APM_ADX */
+
 uint64_t add_n(const uint64_t *u, const uint64_t *v, uint32_t size, uint64_t *w)
 {
     uint64_t cy = 0;
+#ifdef APM_ADX
+    if (apm_adx && size >= 4) {
+        const uint32_t done = size & ~3;
+        cy = add_n_adx(u, v, size / 4, w);
+        u += done;
+        v += done;
+        w += done;
+        size -= done;
+    }
+#endif
     while (size--) {
         uint64_t ud = *u++;
         const uint64_t vd = *v++;
@@ -167,6 +433,16 @@ uint64_t subi_n(uint64_t *u, const uint64_t *v, uint32_t size)
 uint64_t sub_n(const uint64_t *u, const uint64_t *v, uint32_t size, uint64_t *w)
 {
     uint64_t cy = 0;
+#ifdef APM_ADX
+    if (apm_adx && size >= 4) {
+        const uint32_t done = size & ~3;
+        cy = sub_n_adx(u, v, size / 4, w);
+        u += done;
+        v += done;
+        w += done;
+        size -= done;
+    }
+#endif
     while (size--) {
         const uint64_t ud = *u++;
         uint64_t vd = *v++;
@@ -198,10 +474,99 @@ uint64_t sub(const uint64_t *u,
     return cy ? dec(w, usize) : 0;
 }
 
+#ifdef APM_X86_64
 #define digit_mul(u, v, hi, lo) \
     __asm__("mulq %3" : "=a"(lo), "=d"(hi) : "%0"(u), "rm"(v))
+/* (hi, lo) / d => q, r; requires hi < d. */
+#define digit_div(hi, lo, d, q, r) \
+    __asm__("divq %4" : "=a"(q), "=d"(r) : "0"(lo), "1"(hi), "rm"(d))
+#else
+#define digit_mul(u, v, hi, lo)                                        \
+    do {                                                               \
+        const unsigned __int128 __p = (unsigned __int128) (u) * (v); \
+        (hi) = (uint64_t) (__p >> 64);                                 \
+        (lo) = (uint64_t) __p;                                         \
+    } while (0)
+
+/* (hi, lo) / d, in 32-bit halves after normalizing d [cf. Knuth 4.3.1,
+ * vol.2, 3rd ed, algorithm D], since a 128-bit division would call
+ * __udivti3, which the kernel does not provide.
+ */
+static inline uint64_t digit_div_generic(uint64_t hi,
+                                         uint64_t lo,
+                                         uint64_t d,
+                                         uint64_t *r)
+{
+    const unsigned int s = __builtin_clzll(d);
+    d <<= s;
+    hi = s ? (hi << s) | (lo >> (DIGIT_BITS - s)) : hi;
+    lo <<= s;
+
+    const uint64_t dh = d >> 32, dl = d & 0xffffffff;
+    const uint64_t l1 = lo >> 32, l0 = lo & 0xffffffff;
+
+    /* Estimate each quotient half from the top half of d, then correct
+     * it, at most twice.
+     */
+    uint64_t q1 = hi / dh, rhat = hi % dh;
+    while (q1 >> 32 || q1 * dl > ((rhat << 32) | l1)) {
+        q1--;
+        rhat += dh;
+        if (rhat >> 32)
+            break;
+    }
+    const uint64_t mid = ((hi << 32) | l1) - q1 * d;
+
+    uint64_t q0 = mid / dh;
+    rhat = mid % dh;
+    while (q0 >> 32 || q0 * dl > ((rhat << 32) | l0)) {
+        q0--;
+        rhat += dh;
+        if (rhat >> 32)
+            break;
+    }
+    *r = (((mid << 32) | l0) - q0 * d) >> s;
+    return (q1 << 32) | q0;
+}
+
+/* (hi, lo) / d => q, r; requires hi < d. */
+#define digit_div(hi, lo, d, q, r) \
+    ((q) = digit_div_generic((hi), (lo), (d), &(r)))
+#endif /* APM_X86_64 */
 #define digit_sqr(u, hi, lo) digit_mul((u), (u), (hi), (lo))
 
+/* Divide u[size] in place by v, returning the remainder. */
+uint64_t ddivi(uint64_t *u, uint32_t size, uint64_t v)
+{
+    uint64_t r = 0;
+    u += size;
+    while (size--) {
+        uint64_t q;
+        --u;
+        digit_div(r, *u, v, q, r);
+        *u = q;
+    }
+    return r;
+}
+
+/* Divide u[size] in place by 3, which must divide it exactly, multiplying
+ * by the inverse of 3 mod 2^64 rather than dividing [cf. Jebelean, "An
+ * algorithm for exact division", 1993].
+ */
+static void divexact_by3(uint64_t *u, uint32_t size)
+{
+    const uint64_t inv = 0xaaaaaaaaaaaaaaabULL; /* 3 * inv == 1 mod 2^64 */
+    uint64_t cy = 0;
+    for (; size--; u++) {
+        const uint64_t x = *u, d = x - cy;
+        const uint64_t q = d * inv;
+        /* Borrow d < cy, plus the digit carried out of 3 * q. */
+        cy = (d > x) + (q > 0x5555555555555555ULL) +
+             (q > 0xaaaaaaaaaaaaaaaaULL);
+        *u = q;
+    }
+}
+
 uint64_t dmul(const uint64_t *u, uint32_t size, uint64_t v, uint64_t *w)
 {
     if (v <= 1) {
@@ -213,6 +578,15 @@ uint64_t dmul(const uint64_t *u, uint32_t size, uint64_t v, uint64_t *w)
     }
 
     uint64_t cy = 0;
+#ifdef APM_ADX
+    if (apm_adx && size >= 4) {
+        const uint32_t done = size & ~3;
+        cy = dmul_adx(u, size / 4, v, w);
+        u += done;
+        w += done;
+        size -= done;
+    }
+#endif
     while (size--) {
         uint64_t p1, p0;
         digit_mul(*u, v, p1, p0);
@@ -229,6 +603,15 @@ uint64_t dmul_add(const uint64_t *u, uint32_t size, uint64_t v, uint64_t *w)
         return v ? addi_n(w, u, size) : 0;
 
     uint64_t cy = 0;
+#ifdef APM_ADX
+    if (apm_adx && size >= 4) {
+        const uint32_t done = size & ~3;
+        cy = dmul_add_adx(u, size / 4, v, w);
+        u += done;
+        w += done;
+        size -= done;
+    }
+#endif
     while (size--) {
         uint64_t p1, p0;
         digit_mul(*u, v, p1, p0);
@@ -240,8 +623,77 @@ uint64_t dmul_add(const uint64_t *u, uint32_t size, uint64_t v, uint64_t *w)
     return cy;
 }
 
-#define KARATSUBA_MUL_THRESHOLD 32
-#define KARATSUBA_SQR_THRESHOLD 64
+/* Operand sizes, in digits, from which each algorithm takes over from the
+ * one below it; squares of at most BASE_SQR_THRESHOLD digits are plain
+ * products. tests/tune.c measures them on the running CPU and writes
+ * apm-tune.h, which replaces the defaults below, measured on one x86-64
+ * machine. They are variables so that the tuner, and the module parameters
+ * of the same names, can set them too.
+ *
+ * The NTT crossovers lie far above what the driver multiplies: F(MAX_LENGTH)
+ * has about 10850 digits, and fast doubling squares halves of that. In the
+ * module the NTT tier runs only when its thresholds are lowered by hand,
+ * which makes those products slower; it is there for the userspace builds,
+ * whose F(n) can grow past the crossovers.
+ */
+#if __has_include("apm-tune.h")
+#include "apm-tune.h"
+#else
+#define APM_TUNE_BASE_SQR 10
+#define APM_TUNE_KARATSUBA_MUL 40
+#define APM_TUNE_KARATSUBA_SQR 72
+#define APM_TUNE_TOOM3_MUL 240
+#define APM_TUNE_TOOM3_SQR 256
+#define APM_TUNE_NTT_MUL 65536
+#define APM_TUNE_NTT_SQR 40960
+#endif
+
+static struct {
+    uint32_t base_sqr;
+    uint32_t karatsuba_mul;
+    uint32_t karatsuba_sqr;
+    uint32_t toom3_mul;
+    uint32_t toom3_sqr;
+    uint32_t ntt_mul;
+    uint32_t ntt_sqr;
+} apm_tune = {
+    .base_sqr = APM_TUNE_BASE_SQR,
+    .karatsuba_mul = APM_TUNE_KARATSUBA_MUL,
+    .karatsuba_sqr = APM_TUNE_KARATSUBA_SQR,
+    .toom3_mul = APM_TUNE_TOOM3_MUL,
+    .toom3_sqr = APM_TUNE_TOOM3_SQR,
+    .ntt_mul = APM_TUNE_NTT_MUL,
+    .ntt_sqr = APM_TUNE_NTT_SQR,
+};
+
+#define BASE_SQR_THRESHOLD apm_tune.base_sqr
+#define KARATSUBA_MUL_THRESHOLD apm_tune.karatsuba_mul
+#define KARATSUBA_SQR_THRESHOLD apm_tune.karatsuba_sqr
+#define TOOM3_MUL_THRESHOLD apm_tune.toom3_mul
+#define TOOM3_SQR_THRESHOLD apm_tune.toom3_sqr
+#define NTT_MUL_THRESHOLD apm_tune.ntt_mul
+#define NTT_SQR_THRESHOLD apm_tune.ntt_sqr
+
+/* Size from which products split across CPUs, 0 for never; it depends on
+ * the load of the machine more than on the CPU, so tests/tune leaves it be.
+ */
+static uint32_t apm_par_threshold;
+
+/* Raise thresholds set from outside to the smallest sizes the algorithms
+ * split correctly: Karatsuba needs halves of a digit at least, Toom-3 a
+ * top piece.
+ */
+void apm_tune_check(void)
+{
+    apm_tune.karatsuba_mul = max(apm_tune.karatsuba_mul, 2U);
+    apm_tune.karatsuba_sqr = max(apm_tune.karatsuba_sqr, 2U);
+    apm_tune.toom3_mul = max(apm_tune.toom3_mul, 5U);
+    apm_tune.toom3_sqr = max(apm_tune.toom3_sqr, 5U);
+    apm_tune.ntt_mul = max(apm_tune.ntt_mul, 1U);
+    apm_tune.ntt_sqr = max(apm_tune.ntt_sqr, 1U);
+    if (apm_par_threshold)
+        apm_par_threshold = max(apm_par_threshold, 2U);
+}
 
 #ifndef SWAP
 #define SWAP(x, y)           \
@@ -262,6 +714,620 @@ void mul(const uint64_t *u,
 /* Set v[usize*2] = u[usize]^2. */
 void sqr(const uint64_t *u, uint32_t usize, uint64_t *v);
 
+/* Parallel top level.
+ *
+ * From apm_par_threshold digits on, _mul() and _sqr() split their operands
+ * in halves once, Karatsuba-style, and run the three sub-products as tasks
+ * on other CPUs. Each task is a whole mul() or sqr() that allocates its own
+ * scratch and may split again if still large enough. 0 keeps everything on
+ * the calling CPU, which is also what userspace builds do with the tasks,
+ * unless APM_THREADS gives them that many worker threads.
+ */
+#define APM_PAR(size) (apm_par_threshold && (size) >= apm_par_threshold)
+
+struct apm_task {
+    const uint64_t *u, *v; /* v == u for a square */
+    uint32_t usize, vsize;
+    uint64_t *w;
+#ifdef __KERNEL__
+    struct work_struct work;
+    struct mem_counter *count; /* of the task that forked this one */
+#elif defined(APM_THREADS)
+    struct apm_task *next; /* in apm_queue while queued */
+    int state;             /* APM_TASK_* */
+#endif
+};
+
+static void apm_task_run(struct apm_task *t)
+{
+    if (t->u == t->v && t->usize == t->vsize)
+        sqr(t->u, t->usize, t->w);
+    else
+        mul(t->u, t->usize, t->v, t->vsize, t->w);
+}
+
+#ifdef __KERNEL__
+static struct workqueue_struct *apm_wq;
+
+static void apm_task_work(struct work_struct *work)
+{
+    struct apm_task *t = container_of(work, struct apm_task, work);
+
+    mem_count_set(t->count);
+    apm_task_run(t);
+    mem_count_set(NULL);
+}
+
+/* Create the workqueue if the parallel mode is on, or turn it off. */
+static void apm_par_init(void)
+{
+    if (apm_par_threshold && !apm_wq)
+        apm_wq = alloc_workqueue("apm", WQ_UNBOUND, 0);
+    if (!apm_wq)
+        apm_par_threshold = 0;
+}
+
+static void apm_par_exit(void)
+{
+    if (apm_wq)
+        destroy_workqueue(apm_wq);
+    apm_wq = NULL;
+}
+
+static void apm_fork(struct apm_task *t)
+{
+    INIT_WORK_ONSTACK(&t->work, apm_task_work);
+    t->count = mem_count_get();
+    queue_work(apm_wq, &t->work);
+}
+
+/* Wait for @t, running it here if no worker has picked it up yet. Never
+ * blocking on a task that has not started keeps nested splits from
+ * deadlocking when every worker is itself waiting.
+ */
+static void apm_join(struct apm_task *t)
+{
+    if (cancel_work_sync(&t->work))
+        apm_task_run(t);
+    destroy_work_on_stack(&t->work);
+}
+#elif defined(APM_THREADS)
+/* A stand-in for the workqueue, so that userspace tests run the tasks
+ * concurrently: APM_THREADS workers take forked tasks in order, and a
+ * joiner takes back a task none has started, as cancel_work_sync() lets
+ * apm_join() do in the kernel. apm_par_ran and apm_par_taken count the
+ * tasks that went either way.
+ */
+enum { APM_TASK_QUEUED, APM_TASK_RUNNING, APM_TASK_DONE };
+
+static pthread_mutex_t apm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t apm_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t apm_done = PTHREAD_COND_INITIALIZER;
+static struct apm_task *apm_queue, **apm_queue_tail = &apm_queue;
+static pthread_t apm_workers[APM_THREADS];
+static bool apm_running;
+static unsigned long apm_par_ran, apm_par_taken;
+
+static void *apm_worker(void *arg)
+{
+    pthread_mutex_lock(&apm_lock);
+    for (;;) {
+        while (apm_running && !apm_queue)
+            pthread_cond_wait(&apm_queued, &apm_lock);
+        if (!apm_running)
+            break;
+        struct apm_task *t = apm_queue;
+        apm_queue = t->next;
+        if (!apm_queue)
+            apm_queue_tail = &apm_queue;
+        t->state = APM_TASK_RUNNING;
+        pthread_mutex_unlock(&apm_lock);
+
+        apm_task_run(t);
+
+        pthread_mutex_lock(&apm_lock);
+        t->state = APM_TASK_DONE;
+        apm_par_ran++;
+        pthread_cond_broadcast(&apm_done);
+    }
+    pthread_mutex_unlock(&apm_lock);
+    return NULL;
+}
+
+static void apm_par_init(void)
+{
+    if (apm_running)
+        return;
+    apm_running = true;
+    for (int i = 0; i < APM_THREADS; i++)
+        pthread_create(&apm_workers[i], NULL, apm_worker, NULL);
+}
+
+static void apm_par_exit(void)
+{
+    if (!apm_running)
+        return;
+    pthread_mutex_lock(&apm_lock);
+    apm_running = false;
+    pthread_cond_broadcast(&apm_queued);
+    pthread_mutex_unlock(&apm_lock);
+    for (int i = 0; i < APM_THREADS; i++)
+        pthread_join(apm_workers[i], NULL);
+}
+
+static void apm_fork(struct apm_task *t)
+{
+    pthread_mutex_lock(&apm_lock);
+    t->next = NULL;
+    t->state = APM_TASK_QUEUED;
+    *apm_queue_tail = t;
+    apm_queue_tail = &t->next;
+    pthread_cond_signal(&apm_queued);
+    pthread_mutex_unlock(&apm_lock);
+}
+
+static void apm_join(struct apm_task *t)
+{
+    pthread_mutex_lock(&apm_lock);
+    if (t->state == APM_TASK_QUEUED) {
+        struct apm_task **p = &apm_queue;
+        while (*p != t)
+            p = &(*p)->next;
+        *p = t->next;
+        if (!*p)
+            apm_queue_tail = p;
+        apm_par_taken++;
+        pthread_mutex_unlock(&apm_lock);
+        apm_task_run(t);
+        return;
+    }
+    while (t->state != APM_TASK_DONE)
+        pthread_cond_wait(&apm_done, &apm_lock);
+    pthread_mutex_unlock(&apm_lock);
+}
+#else
+#define apm_par_init() ((void) 0)
+#define apm_par_exit() ((void) 0)
+#define apm_fork(t) ((void) (t))
+#define apm_join(t) apm_task_run(t)
+#endif
+
+/* Set d[size] = |U0 - U1| for u0[size] and u1[n1], n1 <= size, returning
+ * whether U1 > U0.
+ */
+static bool par_absdiff(const uint64_t *u0,
+                        uint32_t size,
+                        const uint64_t *u1,
+                        uint32_t n1,
+                        uint64_t *d)
+{
+    if (cmp(u0, size, u1, n1) >= 0) {
+        sub(u0, size, u1, n1, d);
+        return false;
+    }
+    sub(u1, n1, u0, rsize(u0, size), d);
+    zero(d + n1, size - n1);
+    return true;
+}
+
+/* Add mid[size], the middle coefficient of a split at h digits, to the
+ * product w[wsize] holding the outer ones.
+ */
+static void par_add_mid(uint64_t *w,
+                        uint32_t wsize,
+                        uint32_t h,
+                        const uint64_t *mid,
+                        uint32_t size)
+{
+    addi(w + h, wsize - h, mid, rsize(mid, size));
+}
+
+/* v[size*2] = u[size]^2 for a normalized U = U1*B^h + U0 of size >= 2, as
+ * U0^2 + (U0^2 + U1^2 - (U1 - U0)^2)*B^h + U1^2*B^2h.
+ */
+static void sqr_par(const uint64_t *u, uint32_t size, uint64_t *v)
+{
+    const uint32_t h = size / 2, n = size - h;
+    uint64_t *d = APM_TMP_ALLOC(n * 5 + 1), *pm = d + n, *mid = pm + n * 2;
+    struct apm_task t0 = {u, u, h, h, v};
+    struct apm_task t2 = {u + h, u + h, n, n, v + h * 2};
+    struct apm_task tm = {d, d, n, n, pm};
+
+    trace_fib_sqr(FIB_TIER_PAR, size);
+    par_absdiff(u + h, n, u, h, d);
+    apm_fork(&t2);
+    apm_fork(&tm);
+    apm_task_run(&t0);
+    apm_join(&t2);
+    apm_join(&tm);
+
+    copy(v + h * 2, n * 2, mid);
+    mid[n * 2] = addi(mid, n * 2, v, h * 2);
+    subi(mid, n * 2 + 1, pm, n * 2);
+    par_add_mid(v, size * 2, h, mid, n * 2 + 1);
+    APM_TMP_FREE(d);
+}
+
+/* w[usize + vsize] = u[usize] * v[vsize] for normalized operands with
+ * usize >= vsize >= 2. Both are split at the h low digits of U, into
+ * U0*V0, U1*V1 and (U0 - U1)*(V0 - V1) if V reaches past h, or else into
+ * U0*V and U1*V.
+ */
+static void mul_par(const uint64_t *u,
+                    uint32_t usize,
+                    const uint64_t *v,
+                    uint32_t vsize,
+                    uint64_t *w)
+{
+    const uint32_t h = usize - usize / 2, n1 = usize - h;
+    const uint32_t wsize = usize + vsize;
+
+    trace_fib_mul(FIB_TIER_PAR, usize, vsize);
+    if (vsize <= h) {
+        uint64_t *p1 = APM_TMP_ALLOC(n1 + vsize);
+        struct apm_task t0 = {u, v, h, vsize, w};
+        struct apm_task t1 = {u + h, v, n1, vsize, p1};
+
+        apm_fork(&t1);
+        apm_task_run(&t0);
+        apm_join(&t1);
+        zero(w + h + vsize, n1);
+        par_add_mid(w, wsize, h, p1, n1 + vsize);
+        APM_TMP_FREE(p1);
+        return;
+    }
+
+    const uint32_t n2 = vsize - h;
+    uint64_t *d = APM_TMP_ALLOC(h * 6 + 1), *e = d + h, *pm = e + h;
+    uint64_t *mid = pm + h * 2;
+    struct apm_task t0 = {u, v, h, h, w};
+    struct apm_task t2 = {u + h, v + h, n1, n2, w + h * 2};
+    struct apm_task tm = {d, e, h, h, pm};
+
+    /* U0*V1 + U1*V0 = U0*V0 + U1*V1 - (U0 - U1)*(V0 - V1) */
+    const bool neg =
+        par_absdiff(u, h, u + h, n1, d) ^ par_absdiff(v, h, v + h, n2, e);
+    apm_fork(&t2);
+    apm_fork(&tm);
+    apm_task_run(&t0);
+    apm_join(&t2);
+    apm_join(&tm);
+
+    copy(w, h * 2, mid);
+    mid[h * 2] = addi(mid, h * 2, w + h * 2, n1 + n2);
+    if (neg)
+        addi(mid, h * 2 + 1, pm, h * 2);
+    else
+        subi(mid, h * 2 + 1, pm, h * 2);
+    par_add_mid(w, wsize, h, mid, h * 2 + 1);
+    APM_TMP_FREE(d);
+}
+
+/* Number-theoretic transform multiplication.
+ *
+ * The operands are cut into b-bit coefficients and multiplied as
+ * polynomials modulo the prime P = 2^64 - 2^32 + 1, whose multiplicative
+ * group has order divisible by 2^32 and so holds the roots of unity of every
+ * power-of-two length. A product coefficient sums at most n products below
+ * 2^2b, n being the coefficient count of the shorter operand, so it is
+ * recovered exactly while n * 2^2b < P. The widest b from NTT_MAX_BITS down
+ * to NTT_MIN_BITS that keeps this bound is used, 16 bits sufficing for
+ * operands of up to 2^29 digits. Transforms run in O(N log N) against the
+ * N^1.585 of Karatsuba.
+ */
+#define NTT_P 0xffffffff00000001ULL
+#define NTT_GENERATOR 7 /* generates the multiplicative group mod P */
+#define NTT_MIN_BITS 16
+#define NTT_MAX_BITS 24
+
+/* The modular helpers below are written without branches: their operands
+ * are random, so any branch would be mispredicted half of the time.
+ */
+#define NTT_MASK(cond) (-(uint64_t) (cond))
+
+/* Reduce hi * 2^64 + lo mod P, using 2^64 = 2^32 - 1 and 2^96 = -1. */
+static inline uint64_t ntt_reduce(uint64_t hi, uint64_t lo)
+{
+    const uint64_t hh = hi >> 32, hl = hi & 0xffffffff;
+    uint64_t t = lo - hh;
+    t -= NTT_MASK(lo < hh) & 0xffffffff;
+    const uint64_t m = (hl << 32) - hl;
+    uint64_t r = t + m;
+    r += NTT_MASK(r < m) & 0xffffffff;
+    return r - (NTT_MASK(r >= NTT_P) & NTT_P);
+}
+
+static inline uint64_t ntt_mulmod(uint64_t a, uint64_t b)
+{
+    uint64_t hi, lo;
+    digit_mul(a, b, hi, lo);
+    return ntt_reduce(hi, lo);
+}
+
+static inline uint64_t ntt_addmod(uint64_t a, uint64_t b)
+{
+    /* a + b - P, computed as a - (P - b) to catch the wrap-around. */
+    const uint64_t nb = NTT_P - b;
+    const uint64_t r = a - nb;
+    return r + (NTT_MASK(a < nb) & NTT_P);
+}
+
+static inline uint64_t ntt_submod(uint64_t a, uint64_t b)
+{
+    return a - b + (NTT_MASK(a < b) & NTT_P);
+}
+
+static uint64_t ntt_pow(uint64_t b, uint64_t e)
+{
+    uint64_t r = 1;
+    for (; e; e >>= 1, b = ntt_mulmod(b, b)) {
+        if (e & 1)
+            r = ntt_mulmod(r, b);
+    }
+    return r;
+}
+
+/* Coefficient width for operands whose shorter one has @size digits. */
+static unsigned int ntt_bits(uint32_t size)
+{
+    unsigned int bits = NTT_MAX_BITS;
+    for (; bits > NTT_MIN_BITS; bits--) {
+        const uint64_t n = ((uint64_t) size * DIGIT_BITS + bits - 1) / bits;
+        const uint64_t c = ((1ULL << bits) - 1) * ((1ULL << bits) - 1);
+        if (n <= (NTT_P - 1) / c)
+            break;
+    }
+    return bits;
+}
+
+/* Coefficients of @bits bits in @size digits. */
+static uint32_t ntt_coeffs(uint32_t size, unsigned int bits)
+{
+    return ((uint64_t) size * DIGIT_BITS + bits - 1) / bits;
+}
+
+/* Transform length for a product of @size digits. */
+static uint32_t ntt_len(uint32_t size, unsigned int bits)
+{
+    uint32_t len = 1;
+    while (len < ntt_coeffs(size, bits))
+        len <<= 1;
+    return len;
+}
+
+/* Fill tw[0..len/2-1] with the powers of a primitive len-th root of unity,
+ * or of its inverse.
+ */
+static void ntt_twiddles(uint64_t *tw, uint32_t len, bool inverse)
+{
+    uint64_t w = ntt_pow(NTT_GENERATOR, (NTT_P - 1) / len);
+    if (inverse)
+        w = ntt_pow(w, NTT_P - 2);
+    tw[0] = 1;
+    for (uint32_t j = 1; j < len / 2; j++)
+        tw[j] = ntt_mulmod(tw[j - 1], w);
+}
+
+/* Decimation in frequency: natural order in, bit-reversed order out. */
+static void ntt_forward(uint64_t *a, uint32_t len, const uint64_t *tw)
+{
+    for (uint32_t half = len / 2, step = 1; half; half /= 2, step *= 2) {
+        for (uint32_t s = 0; s < len; s += half * 2) {
+            for (uint32_t j = 0; j < half; j++) {
+                const uint64_t x = a[s + j], y = a[s + j + half];
+                a[s + j] = ntt_addmod(x, y);
+                a[s + j + half] = ntt_mulmod(ntt_submod(x, y), tw[j * step]);
+            }
+        }
+    }
+}
+
+/* Decimation in time: bit-reversed order in, natural order out, without
+ * the division by len.
+ */
+static void ntt_inverse(uint64_t *a, uint32_t len, const uint64_t *itw)
+{
+    for (uint32_t half = 1, step = len / 2; half < len; half *= 2, step /= 2) {
+        for (uint32_t s = 0; s < len; s += half * 2) {
+            for (uint32_t j = 0; j < half; j++) {
+                const uint64_t x = a[s + j];
+                const uint64_t y = ntt_mulmod(a[s + j + half], itw[j * step]);
+                a[s + j] = ntt_addmod(x, y);
+                a[s + j + half] = ntt_submod(x, y);
+            }
+        }
+    }
+}
+
+/* Cut u[size] into @len coefficients of @bits bits. */
+static void ntt_split(const uint64_t *u,
+                      uint32_t size,
+                      unsigned int bits,
+                      uint64_t *a,
+                      uint32_t len)
+{
+    const uint32_t n = ntt_coeffs(size, bits);
+    const uint64_t mask = (1ULL << bits) - 1;
+    uint64_t pos = 0;
+    for (uint32_t k = 0; k < n; k++, pos += bits) {
+        const uint32_t i = pos / DIGIT_BITS, shift = pos % DIGIT_BITS;
+        uint64_t c = u[i] >> shift;
+        if (shift + bits > DIGIT_BITS && i + 1 < size)
+            c |= u[i + 1] << (DIGIT_BITS - shift);
+        a[k] = c & mask;
+    }
+    zero(a + n, len - n);
+}
+
+/* Evaluate the product coefficients a[] at 2^bits into w[size]. */
+static void ntt_join(const uint64_t *a,
+                     unsigned int bits,
+                     uint64_t *w,
+                     uint32_t size)
+{
+    const uint32_t n = ntt_coeffs(size, bits);
+    unsigned __int128 acc = 0; /* bits from digit i on */
+    uint32_t i = 0;
+    uint64_t pos = 0;
+    for (uint32_t k = 0; k < n; k++, pos += bits) {
+        while (pos >= (uint64_t) (i + 1) * DIGIT_BITS) {
+            w[i++] = (uint64_t) acc;
+            acc >>= DIGIT_BITS;
+        }
+        acc += (unsigned __int128) a[k] << (pos - (uint64_t) i * DIGIT_BITS);
+    }
+    while (i < size) {
+        w[i++] = (uint64_t) acc;
+        acc >>= DIGIT_BITS;
+    }
+}
+
+static uint32_t ntt_mul_itch(uint32_t size)
+{
+    return ntt_len(size, NTT_MIN_BITS) * 3;
+}
+
+static uint32_t ntt_sqr_itch(uint32_t size)
+{
+    return ntt_len(size, NTT_MIN_BITS) * 2;
+}
+
+/* Set w[usize + vsize] = u[usize] * v[vsize], with ntt_mul_itch(usize +
+ * vsize) digits of scratch.
+ */
+static void ntt_mul(const uint64_t *u,
+                    uint32_t usize,
+                    const uint64_t *v,
+                    uint32_t vsize,
+                    uint64_t *w,
+                    uint64_t *scratch)
+{
+    const unsigned int bits = ntt_bits(min(usize, vsize));
+    const uint32_t len = ntt_len(usize + vsize, bits);
+    uint64_t *a = scratch, *b = a + len;
+    uint64_t *tw = b + len, *itw = tw + len / 2;
+
+    trace_fib_mul(FIB_TIER_NTT, usize, vsize);
+    ntt_twiddles(tw, len, false);
+    ntt_twiddles(itw, len, true);
+    ntt_split(u, usize, bits, a, len);
+    ntt_split(v, vsize, bits, b, len);
+    ntt_forward(a, len, tw);
+    ntt_forward(b, len, tw);
+    /* Pointwise product, folding in the 1/len of the inverse transform. */
+    const uint64_t scale = ntt_pow(len, NTT_P - 2);
+    for (uint32_t i = 0; i < len; i++)
+        a[i] = ntt_mulmod(ntt_mulmod(a[i], b[i]), scale);
+    ntt_inverse(a, len, itw);
+    ntt_join(a, bits, w, usize + vsize);
+}
+
+/* Set v[size * 2] = u[size]^2, with ntt_sqr_itch(size * 2) digits of
+ * scratch.
+ */
+static void ntt_sqr(const uint64_t *u,
+                    uint32_t size,
+                    uint64_t *v,
+                    uint64_t *scratch)
+{
+    const unsigned int bits = ntt_bits(size);
+    const uint32_t len = ntt_len(size * 2, bits);
+    uint64_t *a = scratch;
+    uint64_t *tw = a + len, *itw = tw + len / 2;
+
+    trace_fib_sqr(FIB_TIER_NTT, size);
+    ntt_twiddles(tw, len, false);
+    ntt_twiddles(itw, len, true);
+    ntt_split(u, size, bits, a, len);
+    ntt_forward(a, len, tw);
+    const uint64_t scale = ntt_pow(len, NTT_P - 2);
+    for (uint32_t i = 0; i < len; i++)
+        a[i] = ntt_mulmod(ntt_mulmod(a[i], a[i]), scale);
+    ntt_inverse(a, len, itw);
+    ntt_join(a, bits, v, size * 2);
+}
+
+/* The Karatsuba and Toom-3 routines take their temporaries from a
+ * caller-provided scratch area rather than allocating at every level of the
+ * recursion: each level uses the front of the area and hands the rest down.
+ * The *_itch() helpers return how many digits of scratch a call needs, so
+ * that mul() and sqr() allocate a single area per top-level call.
+ */
+static void _sqr(const uint64_t *u,
+                 uint32_t size,
+                 uint64_t *v,
+                 uint64_t *scratch);
+static void toom3_mul(const uint64_t *u,
+                      const uint64_t *v,
+                      uint32_t size,
+                      uint64_t *w,
+                      uint64_t *scratch);
+static void toom3_sqr(const uint64_t *u,
+                      uint32_t size,
+                      uint64_t *v,
+                      uint64_t *scratch);
+
+/* Toom-3 splits @size digits into pieces of k digits and keeps three
+ * products of 2k + 2 digits next to the evaluated operands.
+ */
+#define TOOM3_PIECE(size) (((size) + 2) / 3)
+#define TOOM3_PRODUCTS(size) ((TOOM3_PIECE(size) * 2 + 2) * 3)
+
+static uint32_t sqr_n_itch(uint32_t size)
+{
+    if (size < KARATSUBA_SQR_THRESHOLD)
+        return 0;
+
+    const uint32_t n = (size & ~1) * 2 + sqr_n_itch(size / 2);
+    if (size < TOOM3_SQR_THRESHOLD)
+        return n;
+    /* Never below what Karatsuba needs, so that the itch grows with the
+     * size and covers the shorter pieces of a Toom-3 split as well.
+     */
+    const uint32_t k = TOOM3_PIECE(size);
+    return max(n, TOOM3_PRODUCTS(size) + (k + 1) + sqr_n_itch(k + 1));
+}
+
+static uint32_t sqr_itch(uint32_t size)
+{
+    if (size >= NTT_SQR_THRESHOLD)
+        return ntt_sqr_itch(size * 2);
+    return sqr_n_itch(size);
+}
+
+static uint32_t mul_n_itch(uint32_t size)
+{
+    uint32_t n = 0;
+    if (size >= KARATSUBA_MUL_THRESHOLD)
+        n = (size & ~1) * 2 + mul_n_itch(size / 2);
+    if (size >= TOOM3_MUL_THRESHOLD) {
+        const uint32_t k = TOOM3_PIECE(size);
+        n = max(n, TOOM3_PRODUCTS(size) + (k + 1) * 2 + mul_n_itch(k + 1));
+    }
+    /* mul_n() squares instead when both operands are the same. */
+    return max(n, sqr_itch(size));
+}
+
+/* Scratch needed by _mul() once usize >= vsize are the real sizes. */
+static uint32_t mul_itch(uint32_t usize, uint32_t vsize)
+{
+    if (vsize < KARATSUBA_MUL_THRESHOLD)
+        return 0;
+    if (vsize >= NTT_MUL_THRESHOLD)
+        return ntt_mul_itch(usize + vsize);
+
+    const uint32_t n = mul_n_itch(vsize);
+    if (usize == vsize)
+        return n;
+
+    /* The remaining U is multiplied piecewise into vsize * 2 digits. */
+    uint32_t inner = usize - vsize >= vsize ? n : 0;
+    const uint32_t rem = usize % vsize;
+    if (rem >= KARATSUBA_MUL_THRESHOLD)
+        inner = max(inner, mul_itch(vsize, rem));
+    return max(n, vsize * 2 + inner);
+}
+
 uint64_t lshift(const uint64_t *u,
                 uint32_t size,
                 unsigned int shift,
@@ -303,6 +1369,23 @@ uint64_t lshifti(uint64_t *u, uint32_t size, unsigned int shift)
     return q;
 }
 
+uint64_t rshifti(uint64_t *u, uint32_t size, unsigned int shift)
+{
+    shift &= DIGIT_BITS - 1;
+    if (!size || !shift)
+        return 0;
+
+    const unsigned int subp = DIGIT_BITS - shift;
+    uint64_t q = 0;
+    u += size;
+    do {
+        const uint64_t p = *--u;
+        *u = (p >> shift) | q;
+        q = p << subp;
+    } while (--size);
+    return q;
+}
+
 /* Multiply u[usize] by v[vsize] and store the result in w[usize + vsize],
  * using the simple quadratic-time algorithm.
  */
@@ -312,15 +1395,18 @@ void _mul_base(const uint64_t *u,
                uint32_t vsize,
                uint64_t *w)
 {
+    trace_fib_mul(FIB_TIER_BASE, usize, vsize);
     /* Find real sizes and zero any part of answer which will not be set. */
     uint32_t ul = rsize(u, usize);
     uint32_t vl = rsize(v, vsize);
+    /* One or both are zero, so none of the answer gets set below. */
+    if (!ul || !vl) {
+        zero(w, usize + vsize);
+        return;
+    }
     /* Zero digits which will not be set in multiply-and-add loop. */
     if (ul + vl != usize + vsize)
         zero(w + (ul + vl), usize + vsize - (ul + vl));
-    /* One or both are zero. */
-    if (!ul || !vl)
-        return;
 
     /* Now multiply by forming partial products and adding them to the result
      * so far. Rather than zero the low ul digits of w before starting, we
@@ -334,10 +1420,6 @@ void _mul_base(const uint64_t *u,
     }
 }
 
-/* TODO: switch to Schönhage–Strassen algorithm
- * https://en.wikipedia.org/wiki/Sch%C3%B6nhage%E2%80%93Strassen_algorithm
- */
-
 /* Karatsuba multiplication [cf. Knuth 4.3.3, vol.2, 3rd ed, pp.294-295]
  * Given U = U1*2^N + U0 and V = V1*2^N + V0,
  * we can recursively compute U*V with
@@ -352,13 +1434,11 @@ void _mul_base(const uint64_t *u,
 static void mul_n(const uint64_t *u,
                   const uint64_t *v,
                   uint32_t size,
-                  uint64_t *w)
+                  uint64_t *w,
+                  uint64_t *scratch)
 {
-    /* TODO: Only allocate a temporary buffer which is large enough for all
-     * following recursive calls, rather than allocating at each call.
-     */
     if (u == v) {
-        sqr(u, size, w);
+        _sqr(u, size, w, scratch);
         return;
     }
 
@@ -367,6 +1447,12 @@ static void mul_n(const uint64_t *u,
         return;
     }
 
+    if (size >= TOOM3_MUL_THRESHOLD) {
+        toom3_mul(u, v, size, w, scratch);
+        return;
+    }
+
+    trace_fib_mul(FIB_TIER_KARATSUBA, size, size);
     const bool odd = size & 1;
     const uint32_t even_size = size - odd;
     const uint32_t half_size = even_size / 2;
@@ -378,8 +1464,8 @@ static void mul_n(const uint64_t *u,
     /* U0 * V0 => w[0..even_size-1]; */
     /* U1 * V1 => w[even_size..2*even_size-1]. */
     if (half_size >= KARATSUBA_MUL_THRESHOLD) {
-        mul_n(u0, v0, half_size, w0);
-        mul_n(u1, v1, half_size, w1);
+        mul_n(u0, v0, half_size, w0, scratch);
+        mul_n(u1, v1, half_size, w1, scratch);
     } else {
         _mul_base(u0, half_size, v0, half_size, w0);
         _mul_base(u1, half_size, v1, half_size, w1);
@@ -389,12 +1475,13 @@ static void mul_n(const uint64_t *u,
      * half_size+even_size-1] in place, we have to make a copy of it now.
      * This later gets used to store U1-U0 and V0-V1.
      */
-    uint64_t *tmp = APM_TMP_COPY(w0, even_size);
+    uint64_t *tmp = scratch;
+    copy(w0, even_size, tmp);
 
     /* w[half_size..half_size+even_size-1] += U1*V1. */
-    addi_n(w + half_size, w1, even_size);
+    uint64_t cy = addi_n(w + half_size, w1, even_size);
     /* w[half_size..half_size+even_size-1] += U0*V0. */
-    addi_n(w + half_size, tmp, even_size);
+    cy += addi_n(w + half_size, tmp, even_size);
 
     /* Get absolute value of U1-U0. */
     uint64_t *u_tmp = tmp;
@@ -412,25 +1499,25 @@ static void mul_n(const uint64_t *u,
         sub_n(v0, v1, half_size, v_tmp);
 
     /* tmp = (U1-U0)*(V0-V1). */
-    tmp = APM_TMP_ALLOC(even_size);
+    tmp = scratch + even_size;
     if (half_size >= KARATSUBA_MUL_THRESHOLD)
-        mul_n(u_tmp, v_tmp, half_size, tmp);
+        mul_n(u_tmp, v_tmp, half_size, tmp, scratch + even_size * 2);
     else
         _mul_base(u_tmp, half_size, v_tmp, half_size, tmp);
-    APM_TMP_FREE(u_tmp);
 
     /* Now add / subtract (U1-U0)*(V0-V1) from
      * w[half_size..half_size+even_size-1] based on whether it is negative or
      * positive.
      */
     if (prod_neg)
-        subi_n(w + half_size, tmp, even_size);
+        cy -= subi_n(w + half_size, tmp, even_size);
     else
-        addi_n(w + half_size, tmp, even_size);
-    APM_TMP_FREE(tmp);
+        cy += addi_n(w + half_size, tmp, even_size);
 
     /* Now if there was any carry from the middle digits (which is at most 2),
      * add that to w[even_size+half_size..2*even_size-1]. */
+    if (cy)
+        daddi(w + even_size + half_size, half_size, cy);
 
     if (odd) {
         /* We have the product U[0..even_size-1] * V[0..even_size-1] in
@@ -442,11 +1529,12 @@ static void mul_n(const uint64_t *u,
     }
 }
 
-void mul(const uint64_t *u,
-         uint32_t usize,
-         const uint64_t *v,
-         uint32_t vsize,
-         uint64_t *w)
+static void _mul(const uint64_t *u,
+                 uint32_t usize,
+                 const uint64_t *v,
+                 uint32_t vsize,
+                 uint64_t *w,
+                 uint64_t *scratch)
 {
     {
         const uint32_t ul = rsize(u, usize);
@@ -475,7 +1563,17 @@ void mul(const uint64_t *u,
         return;
     }
 
-    mul_n(u, v, vsize, w);
+    if (APM_PAR(vsize)) {
+        mul_par(u, usize, v, vsize, w);
+        return;
+    }
+
+    if (vsize >= NTT_MUL_THRESHOLD) {
+        ntt_mul(u, usize, v, vsize, w, scratch);
+        return;
+    }
+
+    mul_n(u, v, vsize, w, scratch);
     if (usize == vsize)
         return;
 
@@ -485,27 +1583,49 @@ void mul(const uint64_t *u,
     u += vsize;
     usize -= vsize;
 
-    uint64_t *tmp = NULL;
-    if (usize >= vsize) {
-        tmp = APM_TMP_ALLOC(vsize * 2);
-        do {
-            mul_n(u, v, vsize, tmp);
-            w += vsize;
-            u += vsize;
-            usize -= vsize;
-        } while (usize >= vsize);
+    /* Every partial product fits in vsize * 2 digits. */
+    uint64_t *tmp = scratch;
+    scratch += vsize * 2;
+    while (usize >= vsize) {
+        mul_n(u, v, vsize, tmp, scratch);
+        addi_n(w, tmp, vsize * 2);
+        w += vsize;
+        u += vsize;
+        usize -= vsize;
     }
 
     if (usize) { /* Size of U isn't a multiple of size of V. */
-        if (!tmp)
-            tmp = APM_TMP_ALLOC(usize + vsize);
         /* Now usize < vsize. Rearrange operands. */
         if (usize < KARATSUBA_MUL_THRESHOLD)
             _mul_base(v, vsize, u, usize, tmp);
         else
-            mul(v, vsize, u, usize, tmp);
+            _mul(v, vsize, u, usize, tmp, scratch);
+        addi_n(w, tmp, usize + vsize);
     }
-    APM_TMP_FREE(tmp);
+}
+
+/* Scratch needed by _mul(u, usize, v, vsize, ...). */
+static uint32_t mul_scratch(const uint64_t *u,
+                            uint32_t usize,
+                            const uint64_t *v,
+                            uint32_t vsize)
+{
+    const uint32_t ul = rsize(u, usize);
+    const uint32_t vl = rsize(v, vsize);
+    return ul < vl ? mul_itch(vl, ul) : mul_itch(ul, vl);
+}
+
+void mul(const uint64_t *u,
+         uint32_t usize,
+         const uint64_t *v,
+         uint32_t vsize,
+         uint64_t *w)
+{
+    const uint32_t n = mul_scratch(u, usize, v, vsize);
+    uint64_t *scratch = n ? APM_TMP_ALLOC(n) : NULL;
+
+    _mul(u, usize, v, vsize, w, scratch);
+    APM_TMP_FREE(scratch);
 }
 
 extern void _mul_base(const uint64_t *u,
@@ -517,21 +1637,24 @@ extern void _mul_base(const uint64_t *u,
 /* Square diagonal. */
 static void sqr_diag(const uint64_t *u, uint32_t size, uint64_t *v)
 {
-    if (!size)
-        return;
+    uint64_t cy = 0;
+#ifdef APM_ADX
+    if (apm_adx && size >= 4) {
+        const uint32_t done = size & ~3;
+        cy = sqr_diag_adx(u, size / 4, v);
+        u += done;
+        v += done * 2;
+        size -= done;
+    }
+#endif
     /* No compiler seems to recognize that if ((A+B) mod 2^N) < A (or B) iff
      * (A+B) >= 2^N and it can use the carry flag after the adds rather than
      * doing comparisons to see if overflow has ocurred. Instead they generate
      * code to perform comparisons, retaining values in already scarce
      * registers after they should be "dead." At any rate this isn't the
      * time-critical part of squaring so it's nothing to lose sleep over. */
-    uint64_t p0, p1;
-    digit_sqr(*u, p1, p0);
-    p1 += (v[0] += p0) < p0;
-    uint64_t cy = (v[1] += p1) < p1;
-    while (--size) {
-        u += 1;
-        v += 2;
+    for (; size--; u++, v += 2) {
+        uint64_t p0, p1;
         digit_sqr(*u, p1, p0);
         p1 += (p0 += cy) < cy;
         p1 += (v[0] += p0) < p0;
@@ -539,12 +1662,9 @@ static void sqr_diag(const uint64_t *u, uint32_t size, uint64_t *v)
     }
 }
 
-#ifndef BASE_SQR_THRESHOLD
-#define BASE_SQR_THRESHOLD 10
-#endif /* !BASE_SQR_THRESHOLD */
-
 static void sqr_base(const uint64_t *u, uint32_t usize, uint64_t *v)
 {
+    trace_fib_sqr(FIB_TIER_SQR_BASE, usize);
     if (!usize)
         return;
 
@@ -602,7 +1722,10 @@ static void sqr_base(const uint64_t *u, uint32_t usize, uint64_t *v)
  * code formula:
  *		U^2 = (2^2N)U1^2 + (2^(N+1))(U1*U0) + U0^2
  */
-void sqr(const uint64_t *u, uint32_t size, uint64_t *v)
+static void sqr_n(const uint64_t *u,
+                  uint32_t size,
+                  uint64_t *v,
+                  uint64_t *scratch)
 {
     uint32_t tmp_rsize = rsize(u, size);
     if (tmp_rsize != size) {
@@ -620,27 +1743,36 @@ void sqr(const uint64_t *u, uint32_t size, uint64_t *v)
         return;
     }
 
+    if (size >= TOOM3_SQR_THRESHOLD) {
+        toom3_sqr(u, size, v, scratch);
+        return;
+    }
+
+    trace_fib_sqr(FIB_TIER_KARATSUBA, size);
     const bool odd_size = size & 1;
     const uint32_t even_size = size & ~1;
     const uint32_t half_size = even_size / 2;
     const uint64_t *u0 = u, *u1 = u + half_size;
     uint64_t *v0 = v, *v1 = v + even_size;
 
-    /* Choose the appropriate squaring function. */
-    void (*sqr_fn)(const uint64_t *, uint32_t, uint64_t *) =
-        (half_size >= KARATSUBA_SQR_THRESHOLD) ? sqr : sqr_base;
     /* Compute the low and high squares, potentially recursively. */
-    sqr_fn(u0, half_size, v0); /* U0^2 => V0 */
-    sqr_fn(u1, half_size, v1); /* U1^2 => V1 */
+    const bool recurse = half_size >= KARATSUBA_SQR_THRESHOLD;
+    if (recurse) {
+        sqr_n(u0, half_size, v0, scratch); /* U0^2 => V0 */
+        sqr_n(u1, half_size, v1, scratch); /* U1^2 => V1 */
+    } else {
+        sqr_base(u0, half_size, v0);
+        sqr_base(u1, half_size, v1);
+    }
 
-    uint64_t *tmp = APM_TMP_ALLOC(even_size * 2);
+    uint64_t *tmp = scratch;
     uint64_t *tmp2 = tmp + even_size;
     /* tmp = w[0..even_size-1] */
     copy(v0, even_size, tmp);
     /* v += U1^2 * 2^N */
-    addi_n(v + half_size, v1, even_size);
+    uint64_t cy = addi_n(v + half_size, v1, even_size);
     /* v += U0^2 * 2^N */
-    addi_n(v + half_size, tmp, even_size);
+    cy += addi_n(v + half_size, tmp, even_size);
 
     int cmp_v = cmp_n(u1, u0, half_size);
     if (cmp_v) {
@@ -648,10 +1780,15 @@ void sqr(const uint64_t *u, uint32_t size, uint64_t *v)
             sub_n(u0, u1, half_size, tmp);
         else
             sub_n(u1, u0, half_size, tmp);
-        sqr_fn(tmp, half_size, tmp2);
-        subi_n(v + half_size, tmp2, even_size);
+        if (recurse)
+            sqr_n(tmp, half_size, tmp2, scratch + even_size * 2);
+        else
+            sqr_base(tmp, half_size, tmp2);
+        cy -= subi_n(v + half_size, tmp2, even_size);
     }
-    APM_TMP_FREE(tmp);
+    /* Propagate the carry out of the middle digits (at most 2). */
+    if (cy)
+        daddi(v + even_size + half_size, half_size, cy);
 
     if (odd_size) {
         v[even_size * 2] = dmul_add(u, even_size, u[even_size], &v[even_size]);
@@ -659,4 +1796,227 @@ void sqr(const uint64_t *u, uint32_t size, uint64_t *v)
     }
 }
 
+/* Toom-Cook 3-way multiplication [cf. Knuth 4.3.3, vol.2, 3rd ed, pp.294-299]
+ * Given U = U2*x^2 + U1*x + U0 and V likewise with x = 2^(64k), the product
+ * W(x) = U(x)V(x) is a polynomial of degree 4, which is recovered from its
+ * values at 0, 1, -1, 2 and infinity:
+ *		W(0) = U0*V0, W(inf) = U2*V2,
+ *		W(1) = (U0+U1+U2)(V0+V1+V2),
+ *		W(-1) = (U0-U1+U2)(V0-V1+V2),
+ *		W(2) = (U0+2U1+4U2)(V0+2V1+4V2)
+ * Five products of about a third of the size replace the nine of the
+ * schoolbook method, for O(n^1.465) against the n^1.585 of Karatsuba.
+ */
+
+/* Set p1[k + 1] = U(1) and pm1[k + 1] = |U(-1)| for u[2k + r], returning
+ * whether U(-1) is negative.
+ */
+static bool toom3_eval_pm1(const uint64_t *u,
+                           uint32_t k,
+                           uint32_t r,
+                           uint64_t *p1,
+                           uint64_t *pm1)
+{
+    const uint64_t *u1 = u + k;
+
+    /* p1 = U0 + U2 */
+    p1[k] = add(u, k, u + k * 2, r, p1);
+    const bool neg = cmp(p1, k + 1, u1, k) < 0;
+    if (neg) {
+        sub_n(u1, p1, k, pm1);
+        pm1[k] = 0;
+    } else {
+        pm1[k] = p1[k] - sub_n(p1, u1, k, pm1);
+    }
+    p1[k] += addi_n(p1, u1, k);
+    return neg;
+}
+
+/* Set p2[k + 1] = U(2) = (2*U2 + U1)*2 + U0 for u[2k + r]. */
+static void toom3_eval_2(const uint64_t *u,
+                         uint32_t k,
+                         uint32_t r,
+                         uint64_t *p2)
+{
+    p2[r] = lshift(u + k * 2, r, 1, p2);
+    zero(p2 + r + 1, k - r);
+    addi(p2, k + 1, u + k, k);
+    lshifti(p2, k + 1, 1);
+    addi(p2, k + 1, u, k);
+}
+
+/* Recover the coefficients of W from w1 = W(1), wm1 = |W(-1)| and
+ * w2 = W(2), all of 2k + 2 digits, and add them into w[4k + 2r], which holds
+ * W(0) in its low 2k digits and W(inf) in its top 2r digits.  The sequence
+ * is Bodrato's, and every intermediate value stays non-negative:
+ *		w2 = (W(2) - W(-1)) / 3
+ *		wm1 = (W(1) - W(-1)) / 2
+ *		w1 = W(1) - W(0)
+ *		w2 = (w2 - w1) / 2 - 2*W(inf)	=> W3
+ *		w1 = w1 - wm1 - W(inf)		=> W2
+ *		wm1 = wm1 - w2			=> W1
+ */
+static void toom3_interpolate(uint64_t *w,
+                              uint32_t k,
+                              uint32_t r,
+                              uint64_t *w1,
+                              uint64_t *wm1,
+                              bool wm1_neg,
+                              uint64_t *w2)
+{
+    const uint32_t n = k * 2 + 2, wsize = k * 4 + r * 2;
+    const uint64_t *w0 = w, *winf = w + k * 4;
+
+    if (wm1_neg)
+        addi_n(w2, wm1, n);
+    else
+        subi_n(w2, wm1, n);
+    divexact_by3(w2, n);
+    if (wm1_neg)
+        addi_n(wm1, w1, n);
+    else
+        sub_n(w1, wm1, n, wm1);
+    rshifti(wm1, n, 1);
+    subi(w1, n, w0, k * 2);
+    subi_n(w2, w1, n);
+    rshifti(w2, n, 1);
+    subi(w2, n, winf, r * 2);
+    subi(w2, n, winf, r * 2);
+    subi_n(w1, wm1, n);
+    subi(w1, n, winf, r * 2);
+    subi_n(wm1, w2, n);
+
+    /* w += W1*x + W2*x^2 + W3*x^3 */
+    zero(w + k * 2, k * 2);
+    addi(w + k, wsize - k, wm1, rsize(wm1, n));
+    addi(w + k * 2, wsize - k * 2, w1, rsize(w1, n));
+    addi(w + k * 3, wsize - k * 3, w2, rsize(w2, n));
+}
+
+/* Set w[size * 2] = u[size] * v[size], with mul_n_itch(size) digits of
+ * scratch.
+ */
+static void toom3_mul(const uint64_t *u,
+                      const uint64_t *v,
+                      uint32_t size,
+                      uint64_t *w,
+                      uint64_t *scratch)
+{
+    const uint32_t k = TOOM3_PIECE(size), r = size - k * 2;
+    uint64_t *w1 = scratch, *wm1 = w1 + k * 2 + 2, *w2 = wm1 + k * 2 + 2;
+    uint64_t *pu = w2 + k * 2 + 2, *pv = pu + k + 1;
+    scratch = pv + k + 1;
+
+    trace_fib_mul(FIB_TIER_TOOM3, size, size);
+    /* |U(-1)| and |V(-1)| wait in the space of W(2). */
+    bool neg = toom3_eval_pm1(u, k, r, pu, w2);
+    neg ^= toom3_eval_pm1(v, k, r, pv, w2 + k + 1);
+    mul_n(pu, pv, k + 1, w1, scratch);
+    mul_n(w2, w2 + k + 1, k + 1, wm1, scratch);
+    toom3_eval_2(u, k, r, pu);
+    toom3_eval_2(v, k, r, pv);
+    mul_n(pu, pv, k + 1, w2, scratch);
+    mul_n(u, v, k, w, scratch);
+    mul_n(u + k * 2, v + k * 2, r, w + k * 4, scratch);
+
+    toom3_interpolate(w, k, r, w1, wm1, neg, w2);
+}
+
+/* Set v[size * 2] = u[size]^2, with sqr_n_itch(size) digits of scratch. */
+static void toom3_sqr(const uint64_t *u,
+                      uint32_t size,
+                      uint64_t *v,
+                      uint64_t *scratch)
+{
+    const uint32_t k = TOOM3_PIECE(size), r = size - k * 2;
+    uint64_t *w1 = scratch, *wm1 = w1 + k * 2 + 2, *w2 = wm1 + k * 2 + 2;
+    uint64_t *p = w2 + k * 2 + 2;
+    scratch = p + k + 1;
+
+    trace_fib_sqr(FIB_TIER_TOOM3, size);
+    toom3_eval_pm1(u, k, r, p, w2);
+    sqr_n(p, k + 1, w1, scratch);
+    sqr_n(w2, k + 1, wm1, scratch);
+    toom3_eval_2(u, k, r, p);
+    sqr_n(p, k + 1, w2, scratch);
+    sqr_n(u, k, v, scratch);
+    sqr_n(u + k * 2, r, v + k * 4, scratch);
+
+    toom3_interpolate(v, k, r, w1, wm1, false, w2);
+}
+
+static void _sqr(const uint64_t *u,
+                 uint32_t size,
+                 uint64_t *v,
+                 uint64_t *scratch)
+{
+    const uint32_t ul = rsize(u, size);
+    if (APM_PAR(ul)) {
+        zero(v + ul * 2, (size - ul) * 2);
+        sqr_par(u, ul, v);
+        return;
+    }
+    if (ul >= NTT_SQR_THRESHOLD) {
+        zero(v + ul * 2, (size - ul) * 2);
+        ntt_sqr(u, ul, v, scratch);
+        return;
+    }
+    sqr_n(u, size, v, scratch);
+}
+
+void sqr(const uint64_t *u, uint32_t size, uint64_t *v)
+{
+    const uint32_t n = sqr_itch(rsize(u, size));
+    uint64_t *scratch = n ? APM_TMP_ALLOC(n) : NULL;
+
+    _sqr(u, size, v, scratch);
+    APM_TMP_FREE(scratch);
+}
+
+/* Given s0[s0size] = F(k-1)^2 and s1[size] = F(k)^2 with s0size <= size,
+ * set w0 and w1, of size + 1 digits each, to (F(2k-1), F(2k)), or to
+ * (F(2k), F(2k+1)) if @up, where
+ *		F(2k-1) = F(k)^2 + F(k-1)^2
+ *		F(2k+1) = 4F(k)^2 - F(k-1)^2 + 2(-1)^k
+ *		F(2k) = F(2k+1) - F(2k-1)
+ * and @odd tells whether k is odd.  All three run in the same pass over the
+ * squares, which w0 and w1 may overwrite.
+ */
+void fib_double(const uint64_t *s0,
+                uint32_t s0size,
+                const uint64_t *s1,
+                uint32_t size,
+                bool odd,
+                bool up,
+                uint64_t *w0,
+                uint64_t *w1)
+{
+    uint64_t lo_cy = 0, mid_cy = 0, prev = 0;
+    int64_t hi_cy = odd ? -2 : 2; /* F(2k+1) may go below zero on the way */
+
+    for (uint32_t i = 0; i <= size; i++) {
+        const uint64_t x0 = i < s0size ? s0[i] : 0;
+        const uint64_t x1 = i < size ? s1[i] : 0;
+        const uint64_t x4 = x1 << 2 | prev >> (DIGIT_BITS - 2);
+        prev = x1;
+
+        uint64_t lo = x1 + lo_cy;
+        lo_cy = lo < lo_cy;
+        lo_cy += (lo += x0) < x0;
+
+        uint64_t hi = x4 + (uint64_t) hi_cy;
+        hi_cy = hi_cy > 0 ? hi < x4 : -(int64_t) (hi > x4);
+        hi_cy -= hi < x0;
+        hi -= x0;
+
+        uint64_t mid = lo + mid_cy;
+        mid_cy = mid < mid_cy;
+        mid_cy += hi < mid;
+        mid = hi - mid;
+
+        w0[i] = up ? mid : lo;
+        w1[i] = up ? hi : mid;
+    }
+}
+
 #endif /* APM_H */
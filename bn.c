@@ -1,12 +1,38 @@
+#ifdef __KERNEL__
 #include <linux/kernel.h>
+#include <linux/moduleparam.h>
 #include <linux/slab.h>
 #include <linux/types.h>
+#endif
 
 #include "apm.h"
 #include "bn.h"
 
 #define BN_INIT_DIGITS ((8 + DIGIT_SIZE - 1) / DIGIT_SIZE)
 
+#ifdef __KERNEL__
+/* Algorithm thresholds of apm.h, in digits. Read-only once loaded, since
+ * scratch sizes computed before a change would not fit the calls after it.
+ */
+module_param_named(base_sqr_threshold, apm_tune.base_sqr, uint, 0444);
+MODULE_PARM_DESC(base_sqr_threshold, "Largest square done as a product");
+module_param_named(karatsuba_mul_threshold, apm_tune.karatsuba_mul, uint, 0444);
+MODULE_PARM_DESC(karatsuba_mul_threshold, "Smallest Karatsuba product");
+module_param_named(karatsuba_sqr_threshold, apm_tune.karatsuba_sqr, uint, 0444);
+MODULE_PARM_DESC(karatsuba_sqr_threshold, "Smallest Karatsuba square");
+module_param_named(toom3_mul_threshold, apm_tune.toom3_mul, uint, 0444);
+MODULE_PARM_DESC(toom3_mul_threshold, "Smallest Toom-3 product");
+module_param_named(toom3_sqr_threshold, apm_tune.toom3_sqr, uint, 0444);
+MODULE_PARM_DESC(toom3_sqr_threshold, "Smallest Toom-3 square");
+module_param_named(ntt_mul_threshold, apm_tune.ntt_mul, uint, 0444);
+MODULE_PARM_DESC(ntt_mul_threshold, "Smallest NTT product");
+module_param_named(ntt_sqr_threshold, apm_tune.ntt_sqr, uint, 0444);
+MODULE_PARM_DESC(ntt_sqr_threshold, "Smallest NTT square");
+module_param_named(parallel_threshold, apm_par_threshold, uint, 0444);
+MODULE_PARM_DESC(parallel_threshold,
+                 "Smallest product split across CPUs (0: never)");
+#endif
+
 static void bn_min_alloc(bn *n, uint32_t s)
 {
     if (n->alloc < s) {
@@ -24,6 +50,32 @@ static void bn_size(bn *n, uint32_t size)
     }
 }
 
+bool bn_reserve(bn *n, uint32_t size)
+{
+    if (n->alloc >= size)
+        return true;
+
+    const uint32_t alloc = (size + 3) & ~3U;
+    uint64_t *digits = resize(n->digits, alloc);
+    if (!digits)
+        return false;
+    n->digits = digits;
+    n->alloc = alloc;
+    return true;
+}
+
+bool bn_cpu_init(bool adx)
+{
+    apm_tune_check();
+    apm_par_init();
+    return apm_init(adx);
+}
+
+void bn_cpu_exit(void)
+{
+    apm_par_exit();
+}
+
 void bn_init(bn *n)
 {
     n->alloc = BN_INIT_DIGITS;
@@ -43,7 +95,7 @@ void bn_free(bn *n)
     FREE(n->digits);
 }
 
-static void bn_set(bn *p, const bn *q)
+void bn_set(bn *p, const bn *q)
 {
     if (p == q)
         return;
@@ -90,7 +142,7 @@ void bn_add(const bn *a, const bn *b, bn *c)
 {
     if (a->size == 0) {
         if (b->size == 0)
-            c->size = 0;  // 0 + 0
+            bn_zero(c);  // 0 + 0
         else
             bn_set(c, b);  // 0 + b
         return;
@@ -113,6 +165,7 @@ void bn_add(const bn *a, const bn *b, bn *c)
             // c = a << 1
             bn_size(c, a->size);
             cy = lshift(a->digits, a->size, 1, c->digits);
+            c->sign = a->sign;
         }
         if (cy) {
             bn_min_alloc(c, c->size + 1);
@@ -140,11 +193,13 @@ void bn_add(const bn *a, const bn *b, bn *c)
         if (cmpv > 0) { /* |A| > |B| */
             /* If B < 0 and |A| > |B|, then C = A - |B| */
             bn_min_alloc(c, a->size);
+            sub(a->digits, a->size, b->digits, b->size, c->digits);
             c->sign = 0;
             size = rsize(c->digits, a->size);
         } else if (cmpv < 0) { /* |A| < |B| */
             /* If B < 0 and |A| < |B|, then C = -(|B| - |A|) */
             bn_min_alloc(c, b->size);
+            sub(b->digits, b->size, a->digits, a->size, c->digits);
             c->sign = 1;
             size = rsize(c->digits, b->size);
         } else { /* |A| = |B| */
@@ -155,7 +210,35 @@ void bn_add(const bn *a, const bn *b, bn *c)
     c->size = size;
 }
 
-void bn_mul(const bn *a, const bn *b, bn *c)
+uint32_t bn_ws_size(uint32_t size)
+{
+    /* One Karatsuba or Toom-3 product plus a leftover piece below the
+     * threshold, or a single transform of both operands.
+     */
+    uint32_t n = size * 2 + mul_n_itch(size);
+    if (size >= NTT_MUL_THRESHOLD)
+        n = max(n, ntt_mul_itch(size * 2 + KARATSUBA_MUL_THRESHOLD));
+    return n;
+}
+
+/* Return scratch of @n digits, taken from @ws unless it is NULL. */
+static uint64_t *bn_ws_get(bn *ws, uint32_t n)
+{
+    if (!n)
+        return NULL;
+    if (!ws)
+        return APM_TMP_ALLOC(n);
+    bn_min_alloc(ws, n);
+    return ws->digits;
+}
+
+static void bn_ws_put(bn *ws, uint64_t *scratch)
+{
+    if (!ws)
+        APM_TMP_FREE(scratch);
+}
+
+void bn_mul_ws(const bn *a, const bn *b, bn *c, bn *ws)
 {
     if (a->size == 0 || b->size == 0) {
         bn_zero(c);
@@ -163,27 +246,35 @@ void bn_mul(const bn *a, const bn *b, bn *c)
     }
 
     if (a == b) {
-        bn_sqr(a, c);
+        bn_sqr_ws(a, c, ws);
         return;
     }
 
     uint32_t csize = a->size + b->size;
+    uint64_t *scratch = bn_ws_get(
+        ws, mul_scratch(a->digits, a->size, b->digits, b->size));
     if (a == c || b == c) {
         uint64_t *prod = APM_TMP_ALLOC(csize);
-        mul(a->digits, a->size, b->digits, b->size, prod);
+        _mul(a->digits, a->size, b->digits, b->size, prod, scratch);
         csize -= (prod[csize - 1] == 0);
         bn_size(c, csize);
         copy(prod, csize, c->digits);
         APM_TMP_FREE(prod);
     } else {
         bn_min_alloc(c, csize);
-        mul(a->digits, a->size, b->digits, b->size, c->digits);
+        _mul(a->digits, a->size, b->digits, b->size, c->digits, scratch);
         c->size = csize - (c->digits[csize - 1] == 0);
     }
+    bn_ws_put(ws, scratch);
     c->sign = a->sign ^ b->sign;
 }
 
-void bn_sqr(const bn *a, bn *b)
+void bn_mul(const bn *a, const bn *b, bn *c)
+{
+    bn_mul_ws(a, b, c, NULL);
+}
+
+void bn_sqr_ws(const bn *a, bn *b, bn *ws)
 {
     if (a->size == 0) {
         bn_zero(b);
@@ -191,21 +282,65 @@ void bn_sqr(const bn *a, bn *b)
     }
 
     uint32_t bsize = a->size * 2;
+    uint64_t *scratch = bn_ws_get(ws, sqr_itch(rsize(a->digits, a->size)));
     if (a == b) {
         uint64_t *prod = APM_TMP_ALLOC(bsize);
-        sqr(a->digits, a->size, prod);
+        _sqr(a->digits, a->size, prod, scratch);
         bsize -= (prod[bsize - 1] == 0);
         bn_size(b, bsize);
         copy(prod, bsize, b->digits);
         APM_TMP_FREE(prod);
     } else {
         bn_min_alloc(b, bsize);
-        sqr(a->digits, a->size, b->digits);
+        _sqr(a->digits, a->size, b->digits, scratch);
         b->size = bsize - (b->digits[bsize - 1] == 0);
     }
+    bn_ws_put(ws, scratch);
     b->sign = 0;
 }
 
+void bn_sqr(const bn *a, bn *b)
+{
+    bn_sqr_ws(a, b, NULL);
+}
+
+void bn_sqr_pair_ws(const bn *a, bn *b, const bn *c, bn *d, bn *ws)
+{
+    if (!APM_PAR(c->size)) {
+        bn_sqr_ws(a, b, ws);
+        bn_sqr_ws(c, d, ws);
+        return;
+    }
+
+    const uint32_t dsize = c->size * 2;
+    bn_min_alloc(d, dsize);
+    struct apm_task t = {c->digits, c->digits, c->size, c->size, d->digits};
+    apm_fork(&t);
+    bn_sqr_ws(a, b, ws);
+    apm_join(&t);
+    d->size = dsize - (d->digits[dsize - 1] == 0);
+    d->sign = 0;
+}
+
+void bn_fib_double(const bn *s0,
+                   const bn *s1,
+                   bool odd,
+                   bool up,
+                   bn *f0,
+                   bn *f1)
+{
+    const uint32_t size = s1->size;
+
+    bn_min_alloc(f0, size + 1);
+    bn_min_alloc(f1, size + 1);
+    fib_double(s0->digits, s0->size, s1->digits, size, odd, up, f0->digits,
+               f1->digits);
+    f0->size = rsize(f0->digits, size + 1);
+    f1->size = rsize(f1->digits, size + 1);
+    f0->sign = 0;
+    f1->sign = 0;
+}
+
 void bn_lshift(const bn *p, unsigned int bits, bn *q)
 {
     if (bits == 0 || bn_is_zero(p)) {
@@ -231,6 +366,7 @@ void bn_lshift(const bn *p, unsigned int bits, bn *q)
     } else {
         bn_size(q, p->size + digits);
         cy = lshift(p->digits, p->size, bits, q->digits + digits);
+        q->sign = p->sign;
     }
 
     zero(q->digits, digits);
@@ -240,43 +376,298 @@ void bn_lshift(const bn *p, unsigned int bits, bn *q)
     }
 }
 
-// char *bn_to_dec_str(const bn *n)
-// {
-//     size_t str_size = (size_t) ((n->size) * DIGIT_BITS) / 3 + 2;
-
-//     if (n->size == 0) {
-//         char *str = kmalloc(2, GFP_KERNEL);
-//         str[0] = '0';
-//         str[1] = '\0';
-//         return str;
-//     } else {
-//         char *s = kmalloc(str_size, GFP_KERNEL);
-//         char *p = s;
-
-//         memset(s, '0', str_size - 1);
-//         s[str_size - 1] = '\0';
-
-//         /* n.digits[0] contains least significant bits */
-//         for (int i = n->size - 1; i >= 0; i--) {
-//             /* walk through every bit of bn */
-//             for (unsigned long long d = 1ULL << 63; d; d >>= 1) {
-//                 /* binary -> decimal string */
-//                 int carry = !!(d & n->digits[i]);
-//                 for (int j = str_size - 2; j >= 0; j--) {
-//                     s[j] += s[j] - '0' + carry;
-//                     carry = (s[j] > '9');
-//                     if (carry)
-//                         s[j] -= 10;
-//                 }
-//             }
-//         }
-//         // skip leading zero
-//         while (p[0] == '0' && p[1] != '\0') {
-//             p++;
-//         }
-//         if (n->sign)
-//             *(--p) = '-';
-//         memmove(s, p, strlen(p) + 1);
-//         return s;
-//     }
-// }
+/* Binary to decimal conversion.
+ *
+ * Repeatedly dividing by 10^19 costs O(n^2) for an n-digit number. Instead,
+ * split the number by pow[i] = 10^(19 * 2^i) and convert both halves
+ * recursively. Each split is a Barrett reduction with the precomputed
+ * reciprocal inv[i] = floor(B^(2m) / pow[i]), m being the size of pow[i] and
+ * B = 2^64, so it costs a few multiplications and the whole conversion runs
+ * in O(M(n) log n) using the Karatsuba routines.
+ */
+#define DEC_DIGITS 19 /* decimal digits per 10^19 "digit" */
+#define DEC_BASE 10000000000000000000ULL
+/* Levels below this are converted by repeated division by DEC_BASE. */
+#define DEC_BASE_LEVEL 4
+#define DEC_MAX_LEVEL 32
+
+struct dec_powers {
+    uint64_t *pow[DEC_MAX_LEVEL];
+    uint64_t *inv[DEC_MAX_LEVEL]; /* size[i] + 1 digits */
+    uint32_t size[DEC_MAX_LEVEL];
+    int levels;
+};
+
+/* mul() and sqr(), but return false instead of running without scratch when
+ * it cannot be allocated.
+ */
+static bool dec_mul(const uint64_t *u,
+                    uint32_t usize,
+                    const uint64_t *v,
+                    uint32_t vsize,
+                    uint64_t *w)
+{
+    const uint32_t n = mul_scratch(u, usize, v, vsize);
+    uint64_t *scratch = n ? APM_TMP_ALLOC(n) : NULL;
+
+    if (n && !scratch)
+        return false;
+    _mul(u, usize, v, vsize, w, scratch);
+    APM_TMP_FREE(scratch);
+    return true;
+}
+
+static bool dec_sqr(const uint64_t *u, uint32_t size, uint64_t *v)
+{
+    const uint32_t n = sqr_itch(rsize(u, size));
+    uint64_t *scratch = n ? APM_TMP_ALLOC(n) : NULL;
+
+    if (n && !scratch)
+        return false;
+    _sqr(u, size, v, scratch);
+    APM_TMP_FREE(scratch);
+    return true;
+}
+
+/* Set c->inv[i] from c->inv[i-1]. Squaring the previous reciprocal gives an
+ * approximation from below with about half of the digits right, one Newton
+ * step X += X * (B^(2m) - D * X) / B^(2m) makes it good to a few units, and
+ * the remainder B^(2m) - D * X tells how many units are still missing.
+ */
+static bool dec_reciprocal(struct dec_powers *c, int i)
+{
+    const uint64_t *d = c->pow[i];
+    const uint32_t m = c->size[i], mp = c->size[i - 1];
+    uint64_t *x = enew(m + 1);
+    uint64_t *sq = APM_TMP_ALLOC((mp + 1) * 2);
+    uint64_t *t = APM_TMP_ALLOC(m * 3 + 1);
+    uint64_t *e = APM_TMP_ALLOC(m * 2);
+    bool ok = false;
+
+    if (!x || !sq || !t || !e)
+        goto out;
+
+    /* X0 = inv[i-1]^2 scaled from B^(4mp) to B^(2m). */
+    if (!dec_sqr(c->inv[i - 1], mp + 1, sq))
+        goto out;
+    copy(sq + (mp * 2 - m) * 2, m + 1, x);
+
+    /* E = B^(2m) - D * X0, which is positive as X0 is too small. */
+    if (!dec_mul(d, m, x, m + 1, t))
+        goto out;
+    for (uint32_t j = 0; j < m * 2; j++)
+        e[j] = ~t[j];
+    inc(e, m * 2);
+
+    /* X1 = X0 + X0 * E / B^(2m). */
+    if (!dec_mul(x, m + 1, e, m * 2, t))
+        goto out;
+    addi_n(x, t + m * 2, m + 1);
+
+    /* R = B^(2m) - D * X1; add one to X1 per multiple of D left in R. */
+    if (!dec_mul(d, m, x, m + 1, t))
+        goto out;
+    for (uint32_t j = 0; j < m * 2; j++)
+        e[j] = ~t[j];
+    inc(e, m * 2);
+    while (cmp(e, m * 2, d, m) >= 0) {
+        subi(e, m * 2, d, m);
+        inc(x, m + 1);
+    }
+    c->inv[i] = x;
+    x = NULL;
+    ok = true;
+out:
+    FREE(x);
+    APM_TMP_FREE(sq);
+    APM_TMP_FREE(e);
+    APM_TMP_FREE(t);
+    return ok;
+}
+
+static void dec_powers_free(struct dec_powers *c)
+{
+    for (int i = 0; i < c->levels; i++) {
+        FREE(c->pow[i]);
+        FREE(c->inv[i]);
+    }
+}
+
+/* Return false, with nothing left to free, if an allocation fails. */
+static bool dec_powers_init(struct dec_powers *c, int levels)
+{
+    /* Small numbers are converted without splitting. */
+    if (levels < DEC_BASE_LEVEL)
+        levels = 0;
+    c->levels = 0;
+    if (!levels)
+        return true;
+
+    c->pow[0] = new0(1);
+    c->inv[0] = new0(3);
+    c->levels = 1;
+    if (!c->pow[0] || !c->inv[0])
+        goto fail;
+    c->pow[0][0] = DEC_BASE;
+    c->size[0] = 1;
+    /* inv[0] = B^2 / 10^19 */
+    c->inv[0][2] = 1;
+    ddivi(c->inv[0], 3, DEC_BASE);
+
+    for (int i = 1; i < levels; i++) {
+        const uint32_t mp = c->size[i - 1];
+        c->pow[i] = enew(mp * 2);
+        c->inv[i] = NULL;
+        c->levels = i + 1;
+        if (!c->pow[i] || !dec_sqr(c->pow[i - 1], mp, c->pow[i]))
+            goto fail;
+        c->size[i] = rsize(c->pow[i], mp * 2);
+        if (!dec_reciprocal(c, i))
+            goto fail;
+    }
+    return true;
+fail:
+    dec_powers_free(c);
+    c->levels = 0;
+    return false;
+}
+
+/* Split u[usize] < pow[i]^2 into q = u / pow[i] and r = u % pow[i], where q
+ * has room for size[i] digits and r for usize digits. Return the real sizes
+ * through qsize and rsz, or false if out of memory.
+ */
+static bool dec_divrem(const struct dec_powers *c,
+                       int i,
+                       const uint64_t *u,
+                       uint32_t usize,
+                       uint64_t *q,
+                       uint32_t *qsize,
+                       uint64_t *r,
+                       uint32_t *rsz)
+{
+    const uint64_t *d = c->pow[i];
+    const uint32_t m = c->size[i];
+
+    if (cmp(u, usize, d, m) < 0) {
+        *qsize = 0;
+        copy(u, usize, r);
+        *rsz = rsize(r, usize);
+        return true;
+    }
+
+    /* Estimate q = ((u / B^(m-1)) * inv) / B^(m+1), off by at most 2. */
+    const uint32_t hsize = usize - (m - 1);
+    uint64_t *t = APM_TMP_ALLOC(hsize + m * 2 + 1);
+    if (!t || !dec_mul(u + m - 1, hsize, c->inv[i], m + 1, t))
+        goto fail;
+    uint32_t qs = rsize(t + m + 1, hsize);
+    copy(t + m + 1, qs, q);
+
+    /* r = u - q * D, then fix up the estimate. */
+    if (!dec_mul(q, qs, d, m, t))
+        goto fail;
+    sub(u, usize, t, rsize(t, qs + m), r);
+    while (cmp(r, usize, d, m) >= 0) {
+        subi(r, usize, d, m);
+        if (inc(q, qs))
+            q[qs++] = 1;
+    }
+    APM_TMP_FREE(t);
+    *qsize = rsize(q, qs);
+    *rsz = rsize(r, usize);
+    return true;
+fail:
+    APM_TMP_FREE(t);
+    return false;
+}
+
+/* Write exactly DEC_DIGITS * 2^level digits of u[usize] < 10^that to out.
+ * Return false if out of memory.
+ */
+static bool dec_convert(const struct dec_powers *c,
+                        const uint64_t *u,
+                        uint32_t usize,
+                        int level,
+                        char *out)
+{
+    const size_t width = (size_t) DEC_DIGITS << level;
+
+    usize = rsize(u, usize);
+    if (!usize) {
+        memset(out, '0', width);
+        return true;
+    }
+
+    if (level < DEC_BASE_LEVEL) {
+        uint64_t *t = APM_TMP_ALLOC(usize);
+        if (!t)
+            return false;
+        copy(u, usize, t);
+        for (char *p = out + width; p > out;) {
+            uint64_t rem = ddivi(t, usize, DEC_BASE);
+            usize = rsize(t, usize);
+            for (int j = 0; j < DEC_DIGITS; j++) {
+                *--p = '0' + rem % 10;
+                rem /= 10;
+            }
+        }
+        APM_TMP_FREE(t);
+        return true;
+    }
+
+    const int i = level - 1;
+    uint32_t qsize, rs;
+    uint64_t *q = APM_TMP_ALLOC(c->size[i] + 1);
+    uint64_t *r = APM_TMP_ALLOC(usize);
+    bool ok = q && r && dec_divrem(c, i, u, usize, q, &qsize, r, &rs) &&
+              dec_convert(c, q, qsize, i, out) &&
+              dec_convert(c, r, rs, i, out + width / 2);
+    APM_TMP_FREE(q);
+    APM_TMP_FREE(r);
+    return ok;
+}
+
+char *bn_to_dec_str(const bn *n)
+{
+    if (n->size == 0) {
+        char *str = MALLOC(2);
+        if (!str)
+            return NULL;
+        str[0] = '0';
+        str[1] = '\0';
+        return str;
+    }
+
+    /* 10^(19 * 2^level) > 2^(63 * 2^level) must exceed |n|. */
+    const uint64_t top = n->digits[n->size - 1];
+    const uint64_t bits =
+        (uint64_t) n->size * DIGIT_BITS - __builtin_clzll(top);
+    int level = 0;
+    while (((uint64_t) 63 << level) < bits)
+        level++;
+
+    const size_t width = (size_t) DEC_DIGITS << level;
+    char *s = MALLOC(width + 2);
+    if (!s)
+        return NULL;
+
+    struct dec_powers c;
+    bool ok = dec_powers_init(&c, level) &&
+              dec_convert(&c, n->digits, n->size, level, s + 1);
+    dec_powers_free(&c);
+    if (!ok) {
+        FREE(s);
+        return NULL;
+    }
+
+    /* skip leading zero */
+    char *p = s + 1;
+    while (p[0] == '0')
+        p++;
+    if (n->sign)
+        *(--p) = '-';
+    size_t len = s + 1 + width - p;
+    memmove(s, p, len);
+    s[len] = '\0';
+    return s;
+}
@@ -1,3 +1,14 @@
+#ifndef BN_H
+#define BN_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else /* libfibbn */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
 typedef struct {
     uint64_t *digits;  /* Digits of number. */
     uint32_t size;     /* Length of number. */
@@ -12,12 +23,30 @@ typedef struct {
         }                                                     \
     }
 
+/* Pick the digit loops for this CPU, the ADX/BMI2 ones if @adx allows and
+ * the CPU has them, which is returned, and settle the algorithm thresholds.
+ * Call once before any other bn_*().
+ */
+bool bn_cpu_init(bool adx);
+
+/* Release what bn_cpu_init() set up. */
+void bn_cpu_exit(void);
+
 void bn_init(bn *p);
 void bn_init_u32(bn *p, uint32_t q);
 void bn_free(bn *p);
 
+/* Make room for @size digits in @p, so that results up to that size are
+ * stored without reallocating. Return false, leaving @p as it was, if out
+ * of memory.
+ */
+bool bn_reserve(bn *p, uint32_t size);
+
 void bn_set_u32(bn *p, uint32_t q);
 
+/* P = Q */
+void bn_set(bn *p, const bn *q);
+
 #define bn_is_zero(n) ((n)->size == 0)
 void bn_zero(bn *p);
 
@@ -34,4 +63,34 @@ void bn_mul(const bn *a, const bn *b, bn *p);
 /* B = A * A */
 void bn_sqr(const bn *a, bn *b);
 
-// char *bn_to_dec_str(const bn *n);
+/* Like bn_mul() and bn_sqr(), but take the multiplication temporaries from
+ * the digits of @ws instead of allocating them on every call. Reserving
+ * bn_ws_size(n) digits of @ws covers operands of at most n digits and
+ * nearly the same size; @ws grows when more is needed.
+ */
+void bn_mul_ws(const bn *a, const bn *b, bn *p, bn *ws);
+void bn_sqr_ws(const bn *a, bn *b, bn *ws);
+uint32_t bn_ws_size(uint32_t size);
+
+/* B = A * A and D = C * C, the latter on another CPU when C is large enough
+ * for the parallel mode. B and D must be distinct from A and C.
+ */
+void bn_sqr_pair_ws(const bn *a, bn *b, const bn *c, bn *d, bn *ws);
+
+/* Given S0 = F(k-1)^2 and S1 = F(k)^2, set (F0, F1) = (F(2k-1), F(2k)), or
+ * (F(2k), F(2k+1)) if @up, in one pass over the squares. @odd is k & 1.
+ * F0 and F1 may be S0 and S1.
+ */
+void bn_fib_double(const bn *s0,
+                   const bn *s1,
+                   bool odd,
+                   bool up,
+                   bn *f0,
+                   bn *f1);
+
+/* Return the decimal representation of n as a string allocated with
+ * MALLOC(), in O(M(n) log n) time, or NULL if out of memory.
+ */
+char *bn_to_dec_str(const bn *n);
+
+#endif /* BN_H */
@@ -1,84 +1,478 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "fibdrv.h"
+
 #define FIB_DEV "/dev/fibonacci"
 
 #define BUF_SIZE 64
 #define DIGIT_BITS 64
 
-// char *bn_to_dec_str(const unsigned long long *digits, size_t size)
-// {
-//     size_t str_size = (size_t) (size * DIGIT_BITS) / 3 + 1;
-
-//     if (size == 0) {
-//         char *str = malloc(2);
-//         str[0] = '0';
-//         str[1] = '\0';
-//         return str;
-//     } else {
-//         char *s = malloc(str_size);
-//         char *p = s;
-
-//         memset(s, '0', str_size - 1);
-//         s[str_size - 1] = '\0';
-
-//         /* n.digits[0] contains least significant bits */
-//         for (int i = size - 1; i >= 0; i--) {
-//             /* walk through every bit of bn */
-//             for (unsigned long long d = 1ULL << 63; d; d >>= 1) {
-//                 /* binary -> decimal string */
-//                 int carry = !!(d & digits[i]);
-//                 for (int j = str_size - 2; j >= 0; j--) {
-//                     s[j] += s[j] - '0' + carry;
-//                     carry = (s[j] > '9');
-//                     if (carry)
-//                         s[j] -= 10;
-//                 }
-//             }
-//         }
-//         // skip leading zero
-//         while (p[0] == '0' && p[1] != '\0') {
-//             p++;
-//         }
-//         memmove(s, p, strlen(p) + 1);
-//         return s;
-//     }
-// }
-
-int main()
+static long long elapsed_ns(const struct timespec *start,
+                            const struct timespec *end)
+{
+    return (long long) (end->tv_sec - start->tv_sec) * 1e9 +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+/* Worker of the multi-process benchmark: pin itself to @cpu, then compute
+ * F(0)..F(MAX_FIB_K) @rounds times through its own file descriptor.
+ */
+static int bench_worker(int cpu, int rounds)
+{
+    unsigned long long buf[BUF_SIZE];
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set))
+        perror("sched_setaffinity");
+
+    int fd = open(FIB_DEV, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open character device");
+        return 1;
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i <= MAX_FIB_K; i++) {
+            lseek(fd, i, SEEK_SET);
+            if (read(fd, buf, sizeof(buf)) < 0) {
+                perror("read");
+                close(fd);
+                return 1;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Run the workload with 1..@max_workers concurrent processes, each pinned to
+ * its own core, and report the aggregate throughput of every configuration.
+ */
+static int bench(int max_workers, int rounds)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    long long ops_per_worker = (long long) rounds * (MAX_FIB_K + 1);
+
+    printf("# workers ops elapsed(ns) ops/s speedup\n");
+    double base = 0;
+    for (int n = 1; n <= max_workers; n++) {
+        struct timespec start, end;
+        int failed = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int w = 0; w < n; w++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                perror("fork");
+                return 1;
+            }
+            if (pid == 0)
+                exit(bench_worker(w % ncpu, rounds));
+        }
+        for (int w = 0; w < n; w++) {
+            int status;
+            if (wait(&status) < 0 || !WIFEXITED(status) ||
+                WEXITSTATUS(status))
+                failed = 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (failed) {
+            fprintf(stderr, "worker failed with %d workers\n", n);
+            return 1;
+        }
+
+        long long ns = elapsed_ns(&start, &end);
+        long long ops = ops_per_worker * n;
+        double rate = ops * 1e9 / ns;
+        if (n == 1)
+            base = rate;
+        printf("%d %lld %lld %.0f %.2f\n", n, ops, ns, rate, rate / base);
+    }
+    return 0;
+}
+
+/* Fetch F(0)..F(MAX_FIB_K) with FIB_IOC_READ_RANGE through a buffer of
+ * @buf_size bytes and report how many ioctls that took.
+ */
+static int batch(size_t buf_size)
+{
+    uint64_t *buf = malloc(buf_size);
+    struct fib_range r = {.start = 0};
+    struct timespec start, end;
+    int calls = 0;
+
+    int fd = open(FIB_DEV, O_RDWR);
+    if (fd < 0 || !buf) {
+        perror("Failed to open character device");
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (r.start <= MAX_FIB_K) {
+        r.count = MAX_FIB_K - r.start + 1;
+        r.buf = (uintptr_t) buf;
+        r.size = buf_size;
+        if (ioctl(fd, FIB_IOC_READ_RANGE, &r) < 0) {
+            perror("FIB_IOC_READ_RANGE");
+            return 1;
+        }
+        r.start += r.done;
+        calls++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    long long ns = elapsed_ns(&start, &end);
+    printf("%d values in %d calls, %lld ns (%lld ns/value)\n", MAX_FIB_K + 1,
+           calls, ns, ns / (MAX_FIB_K + 1));
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+/* Fetch F(step), F(2 * step), ... up to F(MAX_FIB_K) with FIB_IOC_BATCH
+ * through a buffer of BATCH_BUF_SIZE bytes and report how many ioctls that
+ * took.
+ */
+#define BATCH_BUF_SIZE (1 << 20)
+
+static int sparse(uint64_t step)
+{
+    const uint64_t count = step ? MAX_FIB_K / step : 0;
+    uint64_t *ks = malloc(sizeof(*ks) * (count + 1));
+    void *buf = malloc(BATCH_BUF_SIZE);
+    struct fib_batch b = {0};
+    struct timespec start, end;
+    uint64_t next = 0;
+    int calls = 0, fd = -1, ret = 1;
+
+    if (!ks || !buf) {
+        perror("malloc");
+        goto out;
+    }
+    fd = open(FIB_DEV, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open character device");
+        goto out;
+    }
+    for (uint64_t i = 0; i < count; i++)
+        ks[i] = step * (i + 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (next < count) {
+        b.ks = (uintptr_t) (ks + next);
+        b.count = count - next;
+        if (b.count > FIB_BATCH_MAX)
+            b.count = FIB_BATCH_MAX;
+        b.buf = (uintptr_t) buf;
+        b.size = BATCH_BUF_SIZE;
+        if (ioctl(fd, FIB_IOC_BATCH, &b) < 0) {
+            perror("FIB_IOC_BATCH");
+            goto out;
+        }
+        next += b.done;
+        calls++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("%llu values in %d calls, %lld ns\n", (unsigned long long) count,
+           calls, elapsed_ns(&start, &end));
+    ret = 0;
+out:
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    free(ks);
+    return ret;
+}
+
+/* Read the whole F(k) at the current offset in pieces of @chunk bytes,
+ * growing *@res as told by FIB_IOC_GET_LENGTH. Return the number of bytes.
+ */
+static long long read_chunked(int fd, size_t chunk, char **res, size_t *cap)
+{
+    uint64_t length;
+    size_t pos = 0;
+
+    if (ioctl(fd, FIB_IOC_GET_LENGTH, &length) < 0) {
+        perror("FIB_IOC_GET_LENGTH");
+        exit(1);
+    }
+    if (length > *cap) {
+        *cap = length;
+        *res = realloc(*res, *cap);
+        if (!*res) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    for (;;) {
+        size_t want = chunk < length - pos ? chunk : length - pos;
+        ssize_t n = read(fd, *res + pos, want);
+        if (n < 0) {
+            perror("read");
+            exit(1);
+        }
+        if (n == 0)
+            break;
+        pos += n;
+    }
+    return pos;
+}
+
+/* Compute F(0)..F(MAX_FIB_K) into an mmap()ed area of @size bytes and
+ * print the user/kernel time of each, like the default mode does.
+ */
+static int mapped(size_t size)
+{
+    struct timespec start, end;
+
+    int fd = open(FIB_DEV, O_RDWR);
+    if (fd < 0) {
+        perror("Failed to open character device");
+        return 1;
+    }
+    struct fib_mmap_header *hdr =
+        mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (uint64_t i = 0; i <= MAX_FIB_K; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (ioctl(fd, FIB_IOC_MMAP_COMPUTE, &i) < 0) {
+            fprintf(stderr, "F(%llu) needs %llu limbs: ",
+                    (unsigned long long) i, (unsigned long long) hdr->len);
+            perror("FIB_IOC_MMAP_COMPUTE");
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long long ut = elapsed_ns(&start, &end);
+        printf("%llu %lld %llu %lld\n", (unsigned long long) i, ut,
+               (unsigned long long) hdr->ns, ut - (long long) hdr->ns);
+    }
+
+    munmap(hdr, size);
+    close(fd);
+    return 0;
+}
+
+/* Compute F(0)..F(MAX_FIB_K) with up to @depth FIB_IOC_SUBMIT requests in
+ * flight, waiting for them in epoll, and print each as it is collected:
+ * index, time from submission to collection and time spent computing.
+ */
+static int async(int depth)
+{
+    struct timespec sent[MAX_FIB_K + 1], now;
+    struct epoll_event ev = {.events = EPOLLIN};
+    size_t size = 64 * sizeof(uint64_t);
+    uint64_t *buf = malloc(size);
+    int next = 0, done = 0, inflight = 0;
+
+    int fd = open(FIB_DEV, O_RDWR);
+    int ep = epoll_create1(0);
+    if (fd < 0 || ep < 0 || !buf ||
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Failed to set up the character device");
+        return 1;
+    }
+
+    while (done <= MAX_FIB_K) {
+        while (next <= MAX_FIB_K && inflight < depth) {
+            struct fib_submit s = {.tag = next, .k = next};
+            clock_gettime(CLOCK_MONOTONIC, &sent[next]);
+            if (ioctl(fd, FIB_IOC_SUBMIT, &s) < 0) {
+                if (errno == EAGAIN) /* the driver's limit is lower */
+                    break;
+                perror("FIB_IOC_SUBMIT");
+                return 1;
+            }
+            next++;
+            inflight++;
+        }
+        if (epoll_wait(ep, &ev, 1, -1) < 0) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (;;) {
+            struct fib_collect c = {
+                .flags = FIB_COLLECT_ANY,
+                .buf = (uintptr_t) buf,
+                .size = size,
+            };
+            if (ioctl(fd, FIB_IOC_COLLECT, &c) < 0) {
+                if (errno == EAGAIN)
+                    break;
+                if (errno == ENOSPC) {
+                    size = c.len * sizeof(uint64_t);
+                    buf = realloc(buf, size);
+                    if (buf)
+                        continue;
+                }
+                perror("FIB_IOC_COLLECT");
+                return 1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            printf("%llu %lld %llu\n", (unsigned long long) c.k,
+                   elapsed_ns(&sent[c.tag], &now), (unsigned long long) c.ns);
+            done++;
+            inflight--;
+        }
+    }
+
+    close(ep);
+    close(fd);
+    free(buf);
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-p] [-d] [-s|-c bytes] [-b bytes] [-m bytes] "
+            "[-a depth] [-x step] [-j workers] [-r rounds]\n"
+            "  without -j, print F(0)..F(%d) timings of a single reader\n"
+            "  -p    print kernel phases (alloc calc copy) and allocations\n"
+            "  -d    print the numbers in decimal, as converted by the driver\n"
+            "  -s    use streaming mode instead of seeking to every index\n"
+            "  -c C  read every number in chunks of C bytes, any size of k\n"
+            "  -b B  fetch the range in batches through a B-byte buffer\n"
+            "  -m M  receive every number in an M-byte mmap() area\n"
+            "  -a Q  submit with up to Q requests in flight, wait in epoll\n"
+            "  -x S  fetch F(S), F(2S), ... in one batch computation\n"
+            "  -j N  benchmark throughput with 1..N pinned processes\n"
+            "  -r R  rounds of F(0)..F(%d) per process (default 10)\n",
+            prog, MAX_FIB_K, MAX_FIB_K);
+}
+
+int main(int argc, char *argv[])
 {
     unsigned long long buf[BUF_SIZE];
     char write_buf[1];
     int offset = MAX_FIB_K;
     struct timespec start, end;
+    int workers = 0, rounds = 10, phases = 0, stream = 0, decimal = 0, opt;
+    size_t batch_size = 0, chunk = 0, cap = 0, map_size = 0;
+    int depth = 0;
+    uint64_t step = 0;
+    char *res = NULL;
+
+    while ((opt = getopt(argc, argv, "pdsc:b:m:a:x:j:r:")) != -1) {
+        switch (opt) {
+        case 'p':
+            phases = 1;
+            break;
+        case 'd':
+            decimal = 1;
+            break;
+        case 's':
+            stream = 1;
+            break;
+        case 'c':
+            chunk = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            batch_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            map_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'a':
+            depth = atoi(optarg);
+            break;
+        case 'x':
+            step = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (workers > 0)
+        return bench(workers, rounds);
+    if (batch_size > 0)
+        return batch(batch_size);
+    if (map_size > 0)
+        return mapped(map_size);
+    if (depth > 0)
+        return async(depth);
+    if (step > 0)
+        return sparse(step);
 
     int fd = open(FIB_DEV, O_RDWR);
     if (fd < 0) {
         perror("Failed to open character device");
         exit(1);
     }
+    /* Decimal strings outgrow buf, so fetch them in chunks. */
+    if (decimal && !stream && !chunk)
+        chunk = 4096;
+    if (stream || chunk) {
+        uint32_t mode = stream ? FIB_MODE_STREAM : FIB_MODE_CHUNKED;
+        if (decimal)
+            mode |= FIB_MODE_DECIMAL;
+        if (ioctl(fd, FIB_IOC_SET_MODE, &mode) < 0) {
+            perror("FIB_IOC_SET_MODE");
+            exit(1);
+        }
+        lseek(fd, 0, SEEK_SET);
+    }
 
     for (int i = 0; i <= offset; i++) {
-        lseek(fd, i, SEEK_SET);
+        /* In streaming mode every read moves the offset to the next index. */
+        if (!stream)
+            lseek(fd, i, SEEK_SET);
         clock_gettime(CLOCK_MONOTONIC, &start);
-        long long sz = read(fd, buf, sizeof(buf));
+        long long sz = chunk ? read_chunked(fd, chunk, &res, &cap)
+                             : read(fd, buf, sizeof(buf));
         clock_gettime(CLOCK_MONOTONIC, &end);
-        long long ut = (long long) (end.tv_sec - start.tv_sec) * 1e9 +
-                       (end.tv_nsec - start.tv_nsec);
+        long long ut = elapsed_ns(&start, &end);
+        if (phases) {
+            struct fib_timing t;
+            if (ioctl(fd, FIB_IOC_GET_TIMING, &t) < 0) {
+                perror("FIB_IOC_GET_TIMING");
+                exit(1);
+            }
+            printf("%d %lld %llu %llu %llu %llu\n", i, ut,
+                   (unsigned long long) t.alloc, (unsigned long long) t.calc,
+                   (unsigned long long) t.copy, (unsigned long long) t.allocs);
+            continue;
+        }
+        if (decimal) {
+            if (stream && sz > (long long) sizeof(buf))
+                sz = sizeof(buf); /* truncated by read() */
+            char *str = stream ? (char *) buf : res;
+            printf("%d %.*s\n", i, (int) sz, str);
+            continue;
+        }
         long long kt = write(fd, write_buf, 1);
-        // char *str = bn_to_dec_str(buf, sz);
-        // printf("%d %s\n", i, str);
-        // free(str);
         printf("%d %lld %lld %lld\n", i, ut, kt, ut - kt);
         // printf("%d %lld %lld %lld\n", i, kt, kt2, kt3);
     }
 
     close(fd);
+    free(res);
     return 0;
 }
@@ -0,0 +1,301 @@
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/types.h>
+
+#include "fib_ckpt.h"
+#else
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#endif
+
+#include "fib.h"
+#include "fib_trace.h"
+#include "fibdrv.h"
+#include "mem.h"
+
+#ifdef __KERNEL__
+#define fib_now() ktime_get_ns()
+#else
+static uint64_t fib_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Userspace builds have no checkpoint store. */
+static inline bool fib_ckpt_pair(uint64_t n, bn *a0, bn *a1, bn *tmp, bn *a)
+{
+    return false;
+}
+#endif
+
+uint32_t fib_digits(uint64_t n)
+{
+    /* F(n) < phi^n and log2(phi) < 0.6943. */
+    const uint64_t bits = n / 10000 * 6943 + n % 10000 * 6943 / 10000 + 1;
+    return bits / 64 + 1;
+}
+
+/* The loop of fib_doubling(), for numbers already sized for F(n) and the
+ * caller's @ws, so that it never allocates.
+ */
+static void fib_doubling_ws(bn *a0,
+                            bn *a1,
+                            bn *tmp,
+                            bn *a,
+                            uint64_t n,
+                            unsigned int bits,
+                            bn *ws)
+{
+    if (!bits)
+        return;
+
+    /* Two independent squares per bit and no general product: the rest of
+     * the step is a single linear pass in bn_fib_double().
+     */
+    bool odd = (n >> bits) & 1;
+    for (uint64_t k = ((uint64_t) 1) << (bits - 1); k; k >>= 1) {
+        const bool up = n & k;
+        trace_fib_doubling_step(n, __builtin_ctzll(k), a1->size);
+        bn_sqr_pair_ws(a0, tmp, a1, a, ws);     /* tmp = a0^2, a = a1^2 */
+        bn_fib_double(tmp, a, odd, up, a0, a1); /* (a0, a1) at 2m + up */
+        odd = up;
+    }
+}
+
+void fib_doubling(bn *a0,
+                  bn *a1,
+                  bn *tmp,
+                  bn *a,
+                  uint64_t n,
+                  unsigned int bits)
+{
+    if (!bits)
+        return;
+
+    /* Size everything for the last step up front. Products are then written
+     * out of place and the buffers exchanged with bn_swap(), so the loop
+     * below never allocates. The two extra digits cover full-length products
+     * before normalization.
+     */
+    const uint32_t size = fib_digits(n) + 2;
+    bn_reserve(a0, size);
+    bn_reserve(a1, size);
+    bn_reserve(tmp, size);
+    bn_reserve(a, size);
+    bn_t ws = BN_INITIALIZER;
+    bn_reserve(ws, bn_ws_size(fib_digits((n >> 1) + 2)));
+    fib_doubling_ws(a0, a1, tmp, a, n, bits, ws);
+    bn_free(ws);
+}
+
+void fib_pair(uint64_t n, bn *a0, bn *a1, bn *tmp, bn *a)
+{
+    if (fib_ckpt_pair(n, a0, a1, tmp, a))
+        return;
+
+    bn_zero(a0);       /*  a0 = 0 */
+    bn_set_u32(a1, 1); /*  a1 = 1 */
+    /* Start at second-highest bit set. */
+    fib_doubling(a0, a1, tmp, a, n, 63 - __builtin_clzll(n));
+}
+
+void fib_bignum(uint64_t n, bn *fib, struct fib_timing *t)
+{
+    struct fib_timing unused;
+    if (!t)
+        t = &unused;
+
+    struct mem_counter allocs;
+    mem_count_begin(&allocs);
+    uint64_t t0 = fib_now();
+
+    if (n <= 2) {
+        if (n == 0)
+            bn_zero(fib);
+        else
+            bn_set_u32(fib, 1);
+        t->alloc = 0;
+        t->calc = fib_now() - t0;
+        t->allocs = mem_count_end(&allocs);
+        return;
+    }
+
+    bn *a1 = fib; /* Use output param fib as a1 */
+
+    /* Presize the working numbers for F(n) so that fast doubling never
+     * grows them.
+     */
+    const uint32_t size = fib_digits(n) + 2;
+    bn_t a0 = BN_INITIALIZER, tmp = BN_INITIALIZER, a = BN_INITIALIZER;
+    bn_reserve(a0, size);
+    bn_reserve(a1, size);
+    bn_reserve(tmp, size);
+    bn_reserve(a, size);
+    uint64_t t1 = fib_now();
+
+    fib_pair(n, a0, a1, tmp, a);
+    /* Now a1 (alias of output parameter fib) = F[n] */
+    uint64_t t2 = fib_now();
+
+    bn_free(a0);
+    bn_free(tmp);
+    bn_free(a);
+    t->alloc = (t1 - t0) + (fib_now() - t2);
+    t->calc = t2 - t1;
+    t->allocs = mem_count_end(&allocs);
+}
+
+/* fib_batch() reaches F(k) from the previous index p by the addition formula
+ * when the digits of F(k - p) are at most this fraction of those of F(k):
+ * its four products by F(k - p) then cost less than the squares of the
+ * doubling steps.
+ */
+#define FIB_BATCH_ADD_RATIO 16
+
+/* Pair (F(m-1), F(m)) for the prefix m of the j + 1 leading bits of the last
+ * index fib_batch() computed by fast doubling, at level j.
+ */
+struct fib_batch_level {
+    uint64_t m;
+    bn_t f0, f1;
+};
+
+/* Set (f0, f1) = (F(k-1), F(k)) by fast doubling from the longest prefix of
+ * @k found in @levels, of which *@depth are set, and store the pairs of the
+ * further prefixes there. Everything is sized for k already.
+ */
+static void fib_batch_double(struct fib_batch_level *levels,
+                             unsigned int *depth,
+                             uint64_t k,
+                             bn *f0,
+                             bn *f1,
+                             bn *tmp,
+                             bn *a,
+                             bn *ws)
+{
+    const unsigned int bits = 64 - __builtin_clzll(k);
+    unsigned int j = 0;
+
+    while (j < *depth && j < bits && levels[j].m == k >> (bits - 1 - j))
+        j++;
+    if (!j) {
+        levels[0].m = 1;
+        bn_zero(levels[0].f0);
+        bn_set_u32(levels[0].f1, 1);
+        j = 1;
+    }
+    bn_set(f0, levels[j - 1].f0);
+    bn_set(f1, levels[j - 1].f1);
+    for (; j < bits; j++) {
+        const uint64_t m = k >> (bits - 1 - j);
+        fib_doubling_ws(f0, f1, tmp, a, m, 1, ws);
+        levels[j].m = m;
+        bn_set(levels[j].f0, f0);
+        bn_set(levels[j].f1, f1);
+    }
+    *depth = bits;
+}
+
+int fib_batch(const uint64_t *ks,
+              uint32_t count,
+              fib_batch_fn *emit,
+              void *arg)
+{
+    for (uint32_t i = 1; i < count; i++) {
+        if (ks[i] <= ks[i - 1])
+            return -EINVAL;
+    }
+    if (!count)
+        return 0;
+
+    struct fib_batch_level *levels = MALLOC(64 * sizeof(*levels));
+    int ret = 0;
+    if (!levels)
+        return -ENOMEM;
+
+    /* Size everything for the largest index up front, as fib_doubling()
+     * does, so that neither the doubling steps nor the additions allocate:
+     * level j holds F(m) for some m < 2^(j+1), and gaps are only added
+     * while F(d) is at most 1/FIB_BATCH_ADD_RATIO of the digits.
+     */
+    const uint64_t kmax = ks[count - 1];
+    const uint32_t size = fib_digits(kmax) + 2;
+    const uint32_t gsize = size / FIB_BATCH_ADD_RATIO + 2;
+    memset(levels, 0, 64 * sizeof(*levels)); /* all BN_INITIALIZER */
+    for (int j = 0; j < 64; j++) {
+        const uint64_t top = j < 63 ? ((uint64_t) 2 << j) - 1 : ~0ULL;
+        if (top >> 1 <= kmax) {
+            const uint32_t n = fib_digits(top < kmax ? top : kmax) + 2;
+            if (!bn_reserve(levels[j].f0, n) || !bn_reserve(levels[j].f1, n))
+                ret = -ENOMEM;
+        }
+    }
+
+    /* (f0, f1) = (F(p-1), F(p)) for the previous index p, and (g0, g1, g2)
+     * = (F(d-1), F(d), F(d+1)) for the last gap d added to it.
+     */
+    bn_t f0 = BN_INITIALIZER, f1 = BN_INITIALIZER;
+    bn_t g0 = BN_INITIALIZER, g1 = BN_INITIALIZER, g2 = BN_INITIALIZER;
+    bn_t tmp = BN_INITIALIZER, a = BN_INITIALIZER, ws = BN_INITIALIZER;
+    uint64_t gap = 0;
+    unsigned int depth = 0;
+
+    if (!bn_reserve(f0, size) || !bn_reserve(f1, size) ||
+        !bn_reserve(tmp, size) || !bn_reserve(a, size) ||
+        !bn_reserve(g0, gsize) || !bn_reserve(g1, gsize) ||
+        !bn_reserve(g2, gsize) ||
+        !bn_reserve(ws, bn_ws_size(fib_digits((kmax >> 1) + 2))))
+        ret = -ENOMEM;
+
+    for (uint32_t i = 0; i < count && !ret; i++) {
+        const uint64_t k = ks[i], d = i ? k - ks[i - 1] : 0;
+
+        if (!k) {
+            bn_set_u32(f0, 1); /* F(-1) */
+            bn_zero(f1);
+        } else if (i && fib_digits(d) * FIB_BATCH_ADD_RATIO <= fib_digits(k)) {
+            if (d != gap) {
+                bn_zero(g0);
+                bn_set_u32(g1, 1);
+                fib_doubling_ws(g0, g1, tmp, a, d, 63 - __builtin_clzll(d),
+                                ws);
+                bn_add(g0, g1, g2);
+                gap = d;
+            }
+            /* F(p+d)   = F(p) * F(d+1) + F(p-1) * F(d)
+             * F(p+d-1) = F(p) * F(d)   + F(p-1) * F(d-1)
+             */
+            bn_mul_ws(f1, g2, tmp, ws); /* tmp = F(p) * F(d+1) */
+            bn_mul_ws(f0, g1, a, ws);   /*   a = F(p-1) * F(d) */
+            bn_add(tmp, a, a);          /*   a = F(k) */
+            bn_mul_ws(f1, g1, tmp, ws); /* tmp = F(p) * F(d) */
+            bn_swap(f1, a);             /*  f1 = F(k) */
+            bn_mul_ws(f0, g0, a, ws);   /*   a = F(p-1) * F(d-1) */
+            bn_add(tmp, a, f0);         /*  f0 = F(k-1) */
+        } else {
+            fib_batch_double(levels, &depth, k, f0, f1, tmp, a, ws);
+        }
+        ret = emit(arg, k, f1);
+    }
+
+    for (int j = 0; j < 64; j++) {
+        bn_free(levels[j].f0);
+        bn_free(levels[j].f1);
+    }
+    FREE(levels);
+    bn_free(f0);
+    bn_free(f1);
+    bn_free(g0);
+    bn_free(g1);
+    bn_free(g2);
+    bn_free(tmp);
+    bn_free(a);
+    bn_free(ws);
+    return ret;
+}
@@ -0,0 +1,52 @@
+#ifndef FIB_H
+#define FIB_H
+
+#include "bn.h"
+
+/* Return an upper bound of the number of digits of F(n). */
+uint32_t fib_digits(uint64_t n);
+
+/* Advance (a0, a1) = (F(m-1), F(m)), where m = n >> bits, to (F(n-1), F(n))
+ * by fast doubling over the low @bits bits of @n. @tmp and @a are scratch.
+ */
+void fib_doubling(bn *a0,
+                  bn *a1,
+                  bn *tmp,
+                  bn *a,
+                  uint64_t n,
+                  unsigned int bits);
+
+/* Set (a0, a1) = (F(n-1), F(n)) for n >= 1. The module starts from the
+ * checkpoint just below @n (see fib_ckpt.h), userspace from F(1). @tmp and
+ * @a are scratch.
+ */
+void fib_pair(uint64_t n, bn *a0, bn *a1, bn *tmp, bn *a);
+
+struct fib_timing;
+
+/* Set fib = F(n) the way the driver serves a request, with the working
+ * numbers presized for F(n). Unless @t is NULL, store in its alloc, calc
+ * and allocs the time spent setting up and tearing those down, the time in
+ * fib_pair(), and the allocator calls made, which only the module counts.
+ */
+void fib_bignum(uint64_t n, bn *fib, struct fib_timing *t);
+
+/* Called by fib_batch() with F(k); a nonzero return ends the batch. */
+typedef int fib_batch_fn(void *arg, uint64_t k, const bn *fib);
+
+/* Compute F(k) for the @count indices of @ks, which must be strictly
+ * increasing, and hand each to @emit in that order. Rather than running
+ * the fast doubling for every index, each is reached either from the
+ * previous one by the addition formula, or by doubling from the longest
+ * binary prefix it shares with the last doubled one, whose steps are kept.
+ * All numbers are sized for the last index up front. Return 0, -EINVAL for
+ * indices out of order or repeated or -ENOMEM if that sizing fails, both
+ * before computing any, or the first nonzero value of @emit, which ends the
+ * batch.
+ */
+int fib_batch(const uint64_t *ks,
+              uint32_t count,
+              fib_batch_fn *emit,
+              void *arg);
+
+#endif /* FIB_H */
@@ -0,0 +1,162 @@
+#include <linux/debugfs.h>
+#include <linux/hashtable.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#include "fib_cache.h"
+
+static unsigned int cache_entries = 4096;
+module_param(cache_entries, uint, 0644);
+MODULE_PARM_DESC(cache_entries, "Maximum number of cached results (0: off)");
+
+static unsigned int cache_max_kb = 64 * 1024;
+module_param(cache_max_kb, uint, 0644);
+MODULE_PARM_DESC(cache_max_kb, "Memory cap of the result cache in KiB");
+
+struct fib_cache_entry {
+    struct hlist_node node; /* bucket in fib_cache_table */
+    struct list_head lru;   /* position in fib_cache_lru */
+    struct kref ref;        /* held by the table and by readers copying out */
+    uint64_t k;
+    size_t bytes; /* memory charged to the cache */
+    bn_t fib;
+};
+
+#define FIB_CACHE_BITS 12
+
+static DEFINE_HASHTABLE(fib_cache_table, FIB_CACHE_BITS);
+static LIST_HEAD(fib_cache_lru); /* most recently used first */
+static DEFINE_SPINLOCK(fib_cache_lock);
+
+/* Protected by fib_cache_lock. */
+static unsigned int nr_entries;
+static size_t nr_bytes;
+static uint64_t hits, misses, evictions;
+
+static void fib_cache_release(struct kref *ref)
+{
+    struct fib_cache_entry *e = container_of(ref, struct fib_cache_entry, ref);
+
+    bn_free(e->fib);
+    kfree(e);
+}
+
+static struct fib_cache_entry *fib_cache_lookup(uint64_t k)
+{
+    struct fib_cache_entry *e;
+
+    hash_for_each_possible(fib_cache_table, e, node, k)
+    {
+        if (e->k == k)
+            return e;
+    }
+    return NULL;
+}
+
+/* Unlink @e from the cache. Called with fib_cache_lock held. */
+static void fib_cache_unlink(struct fib_cache_entry *e)
+{
+    hash_del(&e->node);
+    list_del(&e->lru);
+    nr_entries--;
+    nr_bytes -= e->bytes;
+    kref_put(&e->ref, fib_cache_release);
+}
+
+bool fib_cache_get(uint64_t k, bn *fib)
+{
+    struct fib_cache_entry *e;
+
+    spin_lock(&fib_cache_lock);
+    e = fib_cache_lookup(k);
+    if (!e) {
+        misses++;
+        spin_unlock(&fib_cache_lock);
+        return false;
+    }
+    hits++;
+    list_move(&e->lru, &fib_cache_lru);
+    kref_get(&e->ref);
+    spin_unlock(&fib_cache_lock);
+
+    /* The digits of a cached entry never change, so copy without the lock. */
+    bn_set(fib, e->fib);
+    kref_put(&e->ref, fib_cache_release);
+    return true;
+}
+
+void fib_cache_put(uint64_t k, const bn *fib)
+{
+    struct fib_cache_entry *e;
+    size_t max_bytes = (size_t) READ_ONCE(cache_max_kb) * 1024;
+    unsigned int max_entries = READ_ONCE(cache_entries);
+
+    if (!max_entries)
+        return;
+
+    e = kzalloc(sizeof(*e), GFP_KERNEL);
+    if (!e)
+        return;
+    bn_init(e->fib);
+    bn_set(e->fib, fib);
+    kref_init(&e->ref);
+    e->k = k;
+    e->bytes = sizeof(*e) + e->fib->alloc * sizeof(uint64_t);
+    if (e->bytes > max_bytes) {
+        fib_cache_release(&e->ref);
+        return;
+    }
+
+    spin_lock(&fib_cache_lock);
+    if (fib_cache_lookup(k)) {
+        /* Raced with another reader computing the same index. */
+        spin_unlock(&fib_cache_lock);
+        fib_cache_release(&e->ref);
+        return;
+    }
+    while (nr_entries &&
+           (nr_entries >= max_entries || nr_bytes + e->bytes > max_bytes)) {
+        fib_cache_unlink(
+            list_last_entry(&fib_cache_lru, struct fib_cache_entry, lru));
+        evictions++;
+    }
+    hash_add(fib_cache_table, &e->node, k);
+    list_add(&e->lru, &fib_cache_lru);
+    nr_entries++;
+    nr_bytes += e->bytes;
+    spin_unlock(&fib_cache_lock);
+}
+
+static int fib_cache_show(struct seq_file *m, void *v)
+{
+    spin_lock(&fib_cache_lock);
+    seq_printf(m, "entries: %u\n", nr_entries);
+    seq_printf(m, "bytes: %zu\n", nr_bytes);
+    seq_printf(m, "hits: %llu\n", hits);
+    seq_printf(m, "misses: %llu\n", misses);
+    seq_printf(m, "evictions: %llu\n", evictions);
+    spin_unlock(&fib_cache_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fib_cache);
+
+int fib_cache_init(struct dentry *dir)
+{
+    hash_init(fib_cache_table);
+    debugfs_create_file("cache", 0444, dir, NULL, &fib_cache_fops);
+    return 0;
+}
+
+void fib_cache_exit(void)
+{
+    struct fib_cache_entry *e, *tmp;
+
+    spin_lock(&fib_cache_lock);
+    list_for_each_entry_safe(e, tmp, &fib_cache_lru, lru)
+        fib_cache_unlink(e);
+    spin_unlock(&fib_cache_lock);
+}
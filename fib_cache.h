@@ -0,0 +1,23 @@
+#ifndef FIB_CACHE_H
+#define FIB_CACHE_H
+
+#include <linux/types.h>
+
+#include "bn.h"
+
+struct dentry;
+
+/* Bounded LRU cache of computed Fibonacci numbers, keyed by index. */
+
+int fib_cache_init(struct dentry *dir);
+void fib_cache_exit(void);
+
+/* Copy the cached F(k) into @fib. Return false on a miss. */
+bool fib_cache_get(uint64_t k, bn *fib);
+
+/* Remember @fib as F(k), evicting the least recently used entries as
+ * needed to stay within the configured limits.
+ */
+void fib_cache_put(uint64_t k, const bn *fib);
+
+#endif /* FIB_CACHE_H */
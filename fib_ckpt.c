@@ -0,0 +1,178 @@
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/module.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include "fib.h"
+#include "fib_ckpt.h"
+
+static unsigned int checkpoint_shift = 16;
+module_param(checkpoint_shift, uint, 0644);
+MODULE_PARM_DESC(checkpoint_shift,
+                 "Keep (F(m-1), F(m)) at multiples of 2^shift (0: off)");
+
+static unsigned int checkpoint_max_kb = 16 * 1024;
+module_param(checkpoint_max_kb, uint, 0644);
+MODULE_PARM_DESC(checkpoint_max_kb, "Memory cap of the checkpoint store in KiB");
+
+struct fib_ckpt {
+    bn_t a0; /* F(m-1) */
+    bn_t a1; /* F(m) */
+};
+
+/* Indexed by m. Entries are never modified and only freed on unload, so
+ * lookups may copy from them without further locking.
+ */
+static DEFINE_XARRAY(fib_ckpt_store);
+static atomic_long_t nr_bytes;
+static atomic64_t hits, misses;
+
+static void fib_ckpt_free(struct fib_ckpt *c)
+{
+    bn_free(c->a0);
+    bn_free(c->a1);
+    kfree(c);
+}
+
+static size_t fib_ckpt_bytes(const struct fib_ckpt *c)
+{
+    return sizeof(*c) + (c->a0->alloc + c->a1->alloc) * sizeof(uint64_t);
+}
+
+static bool fib_ckpt_get(uint64_t m, bn *a0, bn *a1)
+{
+    const struct fib_ckpt *c = xa_load(&fib_ckpt_store, m);
+
+    if (!c)
+        return false;
+    bn_set(a0, c->a0);
+    bn_set(a1, c->a1);
+    return true;
+}
+
+static void fib_ckpt_put(uint64_t m, const bn *a0, const bn *a1)
+{
+    size_t max_bytes = (size_t) READ_ONCE(checkpoint_max_kb) * 1024;
+    struct fib_ckpt *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+    if (!c)
+        return;
+    bn_init(c->a0);
+    bn_init(c->a1);
+    bn_set(c->a0, a0);
+    bn_set(c->a1, a1);
+
+    /* The store only grows, so once full it keeps the checkpoints it has.
+     * The bytes are reserved before inserting, so that concurrent fillers
+     * cannot all pass the cap, and given back if the entry is not kept.
+     */
+    size_t bytes = fib_ckpt_bytes(c);
+    if ((size_t) atomic_long_add_return(bytes, &nr_bytes) > max_bytes ||
+        xa_insert(&fib_ckpt_store, m, c, GFP_KERNEL)) {
+        atomic_long_sub(bytes, &nr_bytes);
+        fib_ckpt_free(c);
+    }
+}
+
+/* Set (a0, a1) = (F(m-1), F(m)) for a checkpoint index @m, resuming from the
+ * longest prefix of m that is itself a stored checkpoint, and store it.
+ */
+static void fib_ckpt_fill(uint64_t m,
+                          unsigned int shift,
+                          bn *a0,
+                          bn *a1,
+                          bn *tmp,
+                          bn *a)
+{
+    if (fib_ckpt_get(m, a0, a1)) {
+        atomic64_inc(&hits);
+        return;
+    }
+    atomic64_inc(&misses);
+
+    /* m >> j is a multiple of 2^shift for every j up to ctz(m) - shift, and
+     * the fewer low bits are left, the shorter the doubling chain.
+     */
+    unsigned int bits, max_j = __builtin_ctzll(m) - shift;
+    for (bits = 1; bits <= max_j; bits++) {
+        if (fib_ckpt_get(m >> bits, a0, a1))
+            break;
+    }
+    if (bits > max_j) {
+        bn_zero(a0);
+        bn_set_u32(a1, 1);
+        bits = 63 - __builtin_clzll(m);
+    }
+    fib_doubling(a0, a1, tmp, a, m, bits);
+    fib_ckpt_put(m, a0, a1);
+}
+
+bool fib_ckpt_pair(uint64_t n, bn *a0, bn *a1, bn *tmp, bn *a)
+{
+    unsigned int shift = READ_ONCE(checkpoint_shift);
+
+    if (!shift || shift >= 63 || n < ((uint64_t) 1 << shift))
+        return false;
+
+    uint64_t m = n & ~(((uint64_t) 1 << shift) - 1), d = n - m;
+    fib_ckpt_fill(m, shift, a0, a1, tmp, a);
+    if (!d)
+        return true;
+
+    /* Finish with the addition formulas
+     *   F(m+d)   = F(m) * F(d+1) + F(m-1) * F(d)
+     *   F(m+d-1) = F(m) * F(d)   + F(m-1) * F(d-1)
+     * where F(d-1), F(d) and F(d+1) are much shorter than F(m).
+     */
+    bn_t p0, p1;
+    bn_init(p0);
+    bn_init_u32(p1, 1);
+    fib_doubling(p0, p1, tmp, a, d, 63 - __builtin_clzll(d));
+
+    bn_mul(a1, p1, tmp); /* tmp = F(m) * F(d) */
+    bn_mul(a0, p0, a);   /*   a = F(m-1) * F(d-1) */
+    bn_add(tmp, a, a);   /*   a = F(n-1) */
+    bn_add(p0, p1, p0);  /*  p0 = F(d+1) */
+    bn_mul(a1, p0, tmp); /* tmp = F(m) * F(d+1) */
+    bn_mul(a0, p1, a0);  /*  a0 = F(m-1) * F(d) */
+    bn_add(tmp, a0, a1); /*  a1 = F(n) */
+    bn_swap(a0, a);      /*  a0 = F(n-1) */
+
+    bn_free(p0);
+    bn_free(p1);
+    return true;
+}
+
+static int fib_ckpt_show(struct seq_file *m, void *v)
+{
+    unsigned long index;
+    struct fib_ckpt *c;
+    unsigned int nr = 0;
+
+    xa_for_each(&fib_ckpt_store, index, c)
+        nr++;
+    seq_printf(m, "checkpoints: %u\n", nr);
+    seq_printf(m, "bytes: %ld\n", atomic_long_read(&nr_bytes));
+    seq_printf(m, "hits: %lld\n", atomic64_read(&hits));
+    seq_printf(m, "misses: %lld\n", atomic64_read(&misses));
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fib_ckpt);
+
+int fib_ckpt_init(struct dentry *dir)
+{
+    debugfs_create_file("checkpoints", 0444, dir, NULL, &fib_ckpt_fops);
+    return 0;
+}
+
+void fib_ckpt_exit(void)
+{
+    unsigned long index;
+    struct fib_ckpt *c;
+
+    xa_for_each(&fib_ckpt_store, index, c)
+        fib_ckpt_free(c);
+    xa_destroy(&fib_ckpt_store);
+}
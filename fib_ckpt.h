@@ -0,0 +1,23 @@
+#ifndef FIB_CKPT_H
+#define FIB_CKPT_H
+
+#include <linux/types.h>
+
+#include "bn.h"
+
+struct dentry;
+
+/* Store of consecutive pairs (F(m-1), F(m)) at every multiple m of
+ * 2^checkpoint_shift, filled lazily as large indices are requested.
+ */
+
+int fib_ckpt_init(struct dentry *dir);
+void fib_ckpt_exit(void);
+
+/* Set (a0, a1) = (F(n-1), F(n)) starting from the checkpoint just below @n.
+ * Return false, leaving everything untouched, if @n lies below the first
+ * checkpoint; the caller then runs the plain fast doubling.
+ */
+bool fib_ckpt_pair(uint64_t n, bn *a0, bn *a1, bn *tmp, bn *a);
+
+#endif /* FIB_CKPT_H */
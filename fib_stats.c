@@ -0,0 +1,76 @@
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+#include "fib_stats.h"
+#include "mem.h"
+
+DEFINE_PER_CPU(struct fib_stats, fib_stats);
+
+static const char *const fib_stat_op_names[FIB_STAT_OPS] = {
+    "read",
+    "range",
+    "mmap",
+    "async",
+    "batch",
+};
+
+/* Counters are read without stopping the writers, so a sum may miss the
+ * updates made meanwhile, and in_flight may be off by those.
+ */
+static int fib_stats_show(struct seq_file *m, void *v)
+{
+    unsigned long requests[FIB_STAT_OPS] = {0};
+    unsigned long bytes = 0, hits = 0, misses = 0;
+    long in_flight = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        const struct fib_stats *s = per_cpu_ptr(&fib_stats, cpu);
+        for (int op = 0; op < FIB_STAT_OPS; op++)
+            requests[op] += READ_ONCE(s->requests[op]);
+        bytes += READ_ONCE(s->bytes);
+        hits += READ_ONCE(s->cache_hits);
+        misses += READ_ONCE(s->cache_misses);
+        in_flight += READ_ONCE(s->in_flight);
+    }
+
+    for (int op = 0; op < FIB_STAT_OPS; op++)
+        seq_printf(m, "%s: %lu\n", fib_stat_op_names[op], requests[op]);
+    seq_printf(m, "in flight: %ld\n", max(in_flight, 0L));
+    seq_printf(m, "bytes to user: %lu\n", bytes);
+    seq_printf(m, "allocs: %lu\n", mem_alloc_count());
+    seq_printf(m, "alloc bytes: %lu\n", mem_alloc_bytes());
+    seq_printf(m, "cache hits: %lu\n", hits);
+    seq_printf(m, "cache misses: %lu\n", misses);
+    seq_printf(m, "cache hit rate: %lu%%\n",
+               hits + misses ? hits * 100 / (hits + misses) : 0);
+
+    /* One row per bin of k, one column per bin of latency. */
+    seq_puts(m, "latency   k <");
+    for (int nb = 0; nb < FIB_STAT_NS_BINS - 1; nb++)
+        seq_printf(m, " %6uus", 2U << nb);
+    seq_printf(m, " %8s\n", "more");
+    for (int kb = 0; kb < FIB_STAT_K_BINS; kb++) {
+        if (kb < FIB_STAT_K_BINS - 1)
+            seq_printf(m, "%13lu", 16UL << (kb * 4));
+        else
+            seq_printf(m, "%13s", "more");
+        for (int nb = 0; nb < FIB_STAT_NS_BINS; nb++) {
+            unsigned long n = 0;
+            for_each_possible_cpu(cpu)
+                n += READ_ONCE(per_cpu(fib_stats, cpu).latency[kb][nb]);
+            seq_printf(m, " %8lu", n);
+        }
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fib_stats);
+
+int fib_stats_init(struct dentry *dir)
+{
+    debugfs_create_file("stats", 0444, dir, NULL, &fib_stats_fops);
+    return 0;
+}
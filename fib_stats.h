@@ -0,0 +1,80 @@
+#ifndef FIB_STATS_H
+#define FIB_STATS_H
+
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+struct dentry;
+
+/* Counters of the requests served, shown in debugfs as "stats". Every
+ * update goes to the copy of the local CPU without locks or shared cache
+ * lines; reading the file sums the copies.
+ */
+
+enum fib_stat_op {
+    FIB_STAT_READ,  /* read(), chunked reads included */
+    FIB_STAT_RANGE, /* FIB_IOC_READ_RANGE */
+    FIB_STAT_MMAP,  /* FIB_IOC_MMAP_COMPUTE */
+    FIB_STAT_ASYNC, /* FIB_IOC_SUBMIT, counted as computed */
+    FIB_STAT_BATCH, /* FIB_IOC_BATCH, by its largest index */
+    FIB_STAT_OPS,
+};
+
+/* Latencies are binned by the index, in powers of 16 from 16 on, and by
+ * time, in powers of two from 2 us on (of 1024 ns each); the last bins are
+ * open-ended.
+ */
+#define FIB_STAT_K_BINS 6
+#define FIB_STAT_NS_BINS 16
+
+struct fib_stats {
+    unsigned long requests[FIB_STAT_OPS];
+    unsigned long latency[FIB_STAT_K_BINS][FIB_STAT_NS_BINS];
+    unsigned long bytes;        /* of numbers copied to userspace */
+    unsigned long cache_hits;   /* results found in the result cache */
+    unsigned long cache_misses; /* results computed */
+    long in_flight;             /* entered minus left on this CPU */
+};
+
+DECLARE_PER_CPU(struct fib_stats, fib_stats);
+
+int fib_stats_init(struct dentry *dir);
+
+/* A request starts, for the count of those in flight. */
+static inline void fib_stats_enter(void)
+{
+    this_cpu_inc(fib_stats.in_flight);
+}
+
+/* A request of @op for F(k) took @ns and handed @bytes to userspace. */
+static inline void fib_stats_leave(enum fib_stat_op op,
+                                   uint64_t k,
+                                   uint64_t ns,
+                                   size_t bytes)
+{
+    const unsigned int kb = k < 16 ? 0 : ilog2(k) / 4;
+    const unsigned int nb = ns < 2048 ? 0 : ilog2(ns >> 10);
+
+    this_cpu_dec(fib_stats.in_flight);
+    this_cpu_inc(fib_stats.requests[op]);
+    this_cpu_inc(fib_stats.latency[min(kb, FIB_STAT_K_BINS - 1U)]
+                                  [min(nb, FIB_STAT_NS_BINS - 1U)]);
+    this_cpu_add(fib_stats.bytes, bytes);
+}
+
+/* @bytes more reached userspace apart from fib_stats_leave(). */
+static inline void fib_stats_copied(size_t bytes)
+{
+    this_cpu_add(fib_stats.bytes, bytes);
+}
+
+static inline void fib_stats_cache(bool hit)
+{
+    if (hit)
+        this_cpu_inc(fib_stats.cache_hits);
+    else
+        this_cpu_inc(fib_stats.cache_misses);
+}
+
+#endif /* FIB_STATS_H */
@@ -0,0 +1,227 @@
+/* Static tracepoints of the driver and its bignum engine, as the events of
+ * the fibdrv system: `perf record -e fibdrv:*`, or
+ * /sys/kernel/tracing/events/fibdrv for ftrace. Disabled, each costs a
+ * patched-out branch. Userspace builds of the engine get empty functions.
+ */
+#ifndef FIB_TRACE_TYPES
+#define FIB_TRACE_TYPES
+
+/* Multiplication algorithms, as reported by fib_mul and fib_sqr. */
+enum fib_tier {
+    FIB_TIER_BASE,      /* schoolbook product */
+    FIB_TIER_SQR_BASE,  /* schoolbook square */
+    FIB_TIER_KARATSUBA, /* one level of Karatsuba */
+    FIB_TIER_TOOM3,     /* one level of Toom-3 */
+    FIB_TIER_NTT,       /* number-theoretic transform */
+    FIB_TIER_PAR,       /* top level split across CPUs */
+};
+
+#endif /* FIB_TRACE_TYPES */
+
+#ifdef __KERNEL__
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fibdrv
+
+#if !defined(FIB_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define FIB_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "fib_stats.h"
+
+TRACE_DEFINE_ENUM(FIB_STAT_READ);
+TRACE_DEFINE_ENUM(FIB_STAT_RANGE);
+TRACE_DEFINE_ENUM(FIB_STAT_MMAP);
+TRACE_DEFINE_ENUM(FIB_STAT_ASYNC);
+TRACE_DEFINE_ENUM(FIB_STAT_BATCH);
+TRACE_DEFINE_ENUM(FIB_TIER_BASE);
+TRACE_DEFINE_ENUM(FIB_TIER_SQR_BASE);
+TRACE_DEFINE_ENUM(FIB_TIER_KARATSUBA);
+TRACE_DEFINE_ENUM(FIB_TIER_TOOM3);
+TRACE_DEFINE_ENUM(FIB_TIER_NTT);
+TRACE_DEFINE_ENUM(FIB_TIER_PAR);
+
+/* clang-format off */
+#define show_fib_op(op)                                   \
+    __print_symbolic(op,                                  \
+                     { FIB_STAT_READ, "read" },           \
+                     { FIB_STAT_RANGE, "range" },         \
+                     { FIB_STAT_MMAP, "mmap" },           \
+                     { FIB_STAT_ASYNC, "async" },         \
+                     { FIB_STAT_BATCH, "batch" })
+
+#define show_fib_tier(tier)                               \
+    __print_symbolic(tier,                                \
+                     { FIB_TIER_BASE, "base" },           \
+                     { FIB_TIER_SQR_BASE, "sqr_base" },   \
+                     { FIB_TIER_KARATSUBA, "karatsuba" }, \
+                     { FIB_TIER_TOOM3, "toom3" },         \
+                     { FIB_TIER_NTT, "ntt" },             \
+                     { FIB_TIER_PAR, "par" })
+
+/* A request of @op for F(k) starts. */
+TRACE_EVENT(fib_request_start,
+
+    TP_PROTO(unsigned int op, u64 k),
+
+    TP_ARGS(op, k),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, op)
+        __field(u64, k)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->k = k;
+    ),
+
+    TP_printk("op=%s k=%llu", show_fib_op(__entry->op), __entry->k)
+);
+
+/* It took @ns and handed @bytes to userspace. */
+TRACE_EVENT(fib_request_end,
+
+    TP_PROTO(unsigned int op, u64 k, u64 ns, size_t bytes),
+
+    TP_ARGS(op, k, ns, bytes),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, op)
+        __field(u64, k)
+        __field(u64, ns)
+        __field(size_t, bytes)
+    ),
+
+    TP_fast_assign(
+        __entry->op = op;
+        __entry->k = k;
+        __entry->ns = ns;
+        __entry->bytes = bytes;
+    ),
+
+    TP_printk("op=%s k=%llu ns=%llu bytes=%zu", show_fib_op(__entry->op),
+              __entry->k, __entry->ns, __entry->bytes)
+);
+
+/* One fast doubling step towards F(n), at bit @bit of n, from F(m) of
+ * @size digits.
+ */
+TRACE_EVENT(fib_doubling_step,
+
+    TP_PROTO(u64 n, unsigned int bit, u32 size),
+
+    TP_ARGS(n, bit, size),
+
+    TP_STRUCT__entry(
+        __field(u64, n)
+        __field(unsigned int, bit)
+        __field(u32, size)
+    ),
+
+    TP_fast_assign(
+        __entry->n = n;
+        __entry->bit = bit;
+        __entry->size = size;
+    ),
+
+    TP_printk("n=%llu bit=%u size=%u", __entry->n, __entry->bit,
+              __entry->size)
+);
+
+/* A product of @usize by @vsize digits runs @tier. */
+TRACE_EVENT(fib_mul,
+
+    TP_PROTO(unsigned int tier, u32 usize, u32 vsize),
+
+    TP_ARGS(tier, usize, vsize),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, tier)
+        __field(u32, usize)
+        __field(u32, vsize)
+    ),
+
+    TP_fast_assign(
+        __entry->tier = tier;
+        __entry->usize = usize;
+        __entry->vsize = vsize;
+    ),
+
+    TP_printk("tier=%s usize=%u vsize=%u", show_fib_tier(__entry->tier),
+              __entry->usize, __entry->vsize)
+);
+
+/* A square of @size digits runs @tier. */
+TRACE_EVENT(fib_sqr,
+
+    TP_PROTO(unsigned int tier, u32 size),
+
+    TP_ARGS(tier, size),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, tier)
+        __field(u32, size)
+    ),
+
+    TP_fast_assign(
+        __entry->tier = tier;
+        __entry->size = size;
+    ),
+
+    TP_printk("tier=%s size=%u", show_fib_tier(__entry->tier),
+              __entry->size)
+);
+
+/* A digit buffer of @size digits is allocated, or grown if @resize. */
+TRACE_EVENT(fib_alloc,
+
+    TP_PROTO(u32 size, bool resize),
+
+    TP_ARGS(size, resize),
+
+    TP_STRUCT__entry(
+        __field(u32, size)
+        __field(bool, resize)
+    ),
+
+    TP_fast_assign(
+        __entry->size = size;
+        __entry->resize = resize;
+    ),
+
+    TP_printk("size=%u%s", __entry->size, __entry->resize ? " resize" : "")
+);
+/* clang-format on */
+
+#endif /* FIB_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fib_trace
+#include <trace/define_trace.h>
+
+#elif !defined(FIB_TRACE_H) /* userspace build of the engine */
+#define FIB_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static inline void trace_fib_doubling_step(uint64_t n,
+                                           unsigned int bit,
+                                           uint32_t size)
+{
+}
+
+static inline void trace_fib_mul(unsigned int tier,
+                                 uint32_t usize,
+                                 uint32_t vsize)
+{
+}
+
+static inline void trace_fib_sqr(unsigned int tier, uint32_t size) {}
+
+static inline void trace_fib_alloc(uint32_t size, bool resize) {}
+
+#endif /* __KERNEL__ */
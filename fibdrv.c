@@ -1,4 +1,5 @@
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/device.h>
 #include <linux/fs.h>
 #include <linux/init.h>
@@ -7,8 +8,21 @@
 #include <linux/ktime.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "bn.h"
+#include "fib.h"
+#include "fib_cache.h"
+#include "fib_ckpt.h"
+#include "fib_stats.h"
+#include "fib_trace.h"
+#include "fibdrv.h"
+#include "mem.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("National Cheng Kung University, Taiwan");
@@ -21,9 +35,70 @@ MODULE_VERSION("0.1");
 
 static dev_t fib_dev = 0;
 static struct class *fib_class;
+static struct dentry *fib_debugfs;
 static DEFINE_MUTEX(fib_mutex);
+static struct workqueue_struct *fib_wq; /* runs FIB_IOC_SUBMIT requests */
 static int major = 0, minor = 0;
-static ktime_t kt;
+
+static unsigned int mmap_max_kb = 16 * 1024;
+module_param(mmap_max_kb, uint, 0644);
+MODULE_PARM_DESC(mmap_max_kb, "Largest mmap() area of one file in KiB");
+
+static bool exclusive = false;
+module_param(exclusive, bool, 0444);
+MODULE_PARM_DESC(exclusive, "Allow only one opener at a time (legacy mode)");
+
+static bool adx = true;
+module_param(adx, bool, 0444);
+MODULE_PARM_DESC(adx, "Use the ADX/BMI2 digit loops if the CPU has them");
+
+static unsigned int async_max = 64;
+module_param(async_max, uint, 0644);
+MODULE_PARM_DESC(async_max,
+                 "Most uncollected FIB_IOC_SUBMIT requests per file");
+
+/* Per-open-file state, hung off file->private_data so that concurrent
+ * openers never share a measurement or a result buffer.
+ */
+struct fib_file {
+    struct mutex lock;        /* serializes threads sharing this file */
+    bn_t fib;                 /* last result, reused across reads */
+    ktime_t kt;               /* duration of the last fib_bignum() call */
+    struct fib_timing timing; /* phase breakdown of the last read */
+    uint32_t mode;            /* FIB_MODE_* flags */
+    uint64_t fib_k;           /* fib = F(fib_k) if fib_valid */
+    bool fib_valid;
+    bn_t next; /* F(fib_k + 1) if next_valid, kept for streaming */
+    bool next_valid;
+    size_t chunk_pos; /* bytes of fib already read in chunked mode */
+    char *dec;        /* decimal string of F(dec_k), built on demand */
+    size_t dec_len;
+    uint64_t dec_k;
+    /* Guards the three fields below. Taken inside ff->lock and mmap_lock,
+     * so never held across a user copy, which could fault into mmap_lock.
+     */
+    struct mutex map_lock;
+    void *map; /* area shared with userspace through mmap() */
+    size_t map_size;
+    unsigned int map_users; /* live mappings of map */
+    struct mutex async_lock;      /* guards the fields below */
+    struct list_head async;       /* struct fib_async, in submission order */
+    unsigned int async_nr;        /* requests in async */
+    unsigned int async_ready;     /* those of them computed */
+    wait_queue_head_t async_wait; /* woken as requests complete or leave */
+};
+
+/* A FIB_IOC_SUBMIT request, computed on fib_wq until collected. */
+struct fib_async {
+    struct list_head node; /* in fib_file.async */
+    struct work_struct work;
+    struct fib_file *ff;
+    uint64_t tag;
+    uint64_t k;
+    uint64_t ns; /* time spent computing fib */
+    bool ready;  /* fib = F(k) */
+    bn_t fib;
+};
 
 // static uint64_t fib_sequence(uint64_t k)
 // {
@@ -87,86 +162,250 @@ static ktime_t kt;
 //     return a;
 // }
 
-static void fib_bignum(uint64_t n, bn *fib)
+/* Set fib = F(k), from the cache if it has it. */
+static void fib_lookup(uint64_t k, bn *fib, struct fib_timing *t)
 {
-    if (unlikely(n <= 2)) {
-        if (n == 0)
-            bn_zero(fib);
-        else
-            bn_set_u32(fib, 1);
-        return;
+    if (fib_cache_get(k, fib)) {
+        fib_stats_cache(true);
+        t->alloc = 0;
+        t->calc = 0;
+        t->allocs = 0;
+    } else {
+        fib_stats_cache(false);
+        fib_bignum(k, fib, t);
+        fib_cache_put(k, fib);
     }
+}
 
-    bn *a1 = fib; /* Use output param fib as a1 */
-
-    bn_t a0, tmp, a;
-    bn_init_u32(a0, 0); /*  a0 = 0 */
-    bn_set_u32(a1, 1);  /*  a1 = 1 */
-    bn_init(tmp);       /* tmp = 0 */
-    bn_init(a);
+static void fib_time_proxy(struct fib_file *ff, uint64_t k)
+{
+    ff->fib_k = k;
+    ff->fib_valid = true;
+    ff->next_valid = false;
+    ff->kt = ktime_get();
+    fib_lookup(k, ff->fib, &ff->timing);
+    ff->kt = ktime_sub(ktime_get(), ff->kt);
+}
 
-    /* Start at second-highest bit set. */
-    for (uint64_t k = ((uint64_t) 1) << (62 - __builtin_clzll(n)); k; k >>= 1) {
-        /* Both ways use two squares, two adds, one multipy and one shift. */
-        bn_lshift(a0, 1, a); /* a03 = a0 * 2 */
-        bn_add(a, a1, a);    /*   ... + a1 */
-        bn_sqr(a1, tmp);     /* tmp = a1^2 */
-        bn_sqr(a0, a0);      /* a0 = a0 * a0 */
-        bn_add(a0, tmp, a0); /*  ... + a1 * a1 */
-        bn_mul(a1, a, a1);   /*  a1 = a1 * a */
-        if (k & n) {
-            bn_swap(a1, a0);    /*  a1 <-> a0 */
-            bn_add(a0, a1, a1); /*  a1 += a0 */
-        }
+/* Bring ff->fib to F(k) in streaming mode. Reading the index right after the
+ * previous one costs a single addition; any other index is computed afresh
+ * together with F(k+1).
+ */
+static void fib_stream(struct fib_file *ff, uint64_t k)
+{
+    struct mem_counter allocs;
+    mem_count_begin(&allocs);
+    ff->kt = ktime_get();
+    ff->timing.alloc = 0;
+    bool valid = ff->fib_valid && ff->next_valid;
+    if (valid && k == ff->fib_k + 1) {
+        bn_add(ff->fib, ff->next, ff->fib); /* fib = F(k+1) */
+        bn_swap(ff->fib, ff->next);         /* fib = F(k), next = F(k+1) */
+    } else if (!valid || k != ff->fib_k) {
+        bn_t tmp, a;
+        bn_init(tmp);
+        bn_init(a);
+        fib_pair(k + 1, ff->fib, ff->next, tmp, a);
+        bn_free(tmp);
+        bn_free(a);
     }
-    /* Now a1 (alias of output parameter fib) = F[n] */
+    ff->fib_k = k;
+    ff->fib_valid = true;
+    ff->next_valid = true;
+    ff->kt = ktime_sub(ktime_get(), ff->kt);
+    ff->timing.calc = ktime_to_ns(ff->kt);
+    ff->timing.allocs = mem_count_end(&allocs);
+}
 
-    bn_free(a0);
-    bn_free(tmp);
-    bn_free(a);
+/* Account a request of @op for F(k) to the statistics and the trace. */
+static void fib_request_begin(enum fib_stat_op op, uint64_t k)
+{
+    fib_stats_enter();
+    trace_fib_request_start(op, k);
 }
 
-static void fib_time_proxy(uint64_t k, bn *result)
+static void fib_request_done(enum fib_stat_op op,
+                             uint64_t k,
+                             uint64_t ns,
+                             size_t bytes)
 {
-    kt = ktime_get();
-    fib_bignum(k, result);
-    kt = ktime_sub(ktime_get(), kt);
+    trace_fib_request_end(op, k, ns, bytes);
+    fib_stats_leave(op, k, ns, bytes);
 }
 
 static int fib_open(struct inode *inode, struct file *file)
 {
-    if (!mutex_trylock(&fib_mutex)) {
+    if (exclusive && !mutex_trylock(&fib_mutex)) {
         printk(KERN_ALERT "fibdrv is in use\n");
         return -EBUSY;
     }
+
+    /* Zeroed memory is a valid BN_INITIALIZER for ff->fib and ff->next. */
+    struct fib_file *ff = kzalloc(sizeof(*ff), GFP_KERNEL);
+    if (!ff) {
+        if (exclusive)
+            mutex_unlock(&fib_mutex);
+        return -ENOMEM;
+    }
+    mutex_init(&ff->lock);
+    mutex_init(&ff->map_lock);
+    mutex_init(&ff->async_lock);
+    INIT_LIST_HEAD(&ff->async);
+    init_waitqueue_head(&ff->async_wait);
+    file->private_data = ff;
     return 0;
 }
 
+static void fib_async_free(struct fib_async *a)
+{
+    bn_free(a->fib);
+    kfree(a);
+}
+
 static int fib_release(struct inode *inode, struct file *file)
 {
-    mutex_unlock(&fib_mutex);
+    struct fib_file *ff = file->private_data;
+    struct fib_async *a, *next;
+
+    /* Drop the requests not started yet and wait for the others. */
+    list_for_each_entry_safe(a, next, &ff->async, node) {
+        cancel_work_sync(&a->work);
+        fib_async_free(a);
+    }
+    mutex_destroy(&ff->async_lock);
+    mutex_destroy(&ff->map_lock);
+    mutex_destroy(&ff->lock);
+    bn_free(ff->fib);
+    bn_free(ff->next);
+    FREE(ff->dec);
+    vfree(ff->map);
+    kfree(ff);
+    if (exclusive)
+        mutex_unlock(&fib_mutex);
     return 0;
 }
 
+/* Point data at what read() hands out for the held result: its limbs, or in
+ * decimal mode its decimal string, converted at most once per index and
+ * accounted to the calc phase.
+ */
+static int fib_output(struct fib_file *ff, const void **data, size_t *len)
+{
+    if (!(ff->mode & FIB_MODE_DECIMAL)) {
+        *data = ff->fib->digits;
+        *len = sizeof(uint64_t) * ff->fib->size;
+        return 0;
+    }
+
+    if (!ff->dec || ff->dec_k != ff->fib_k) {
+        ktime_t start = ktime_get();
+        FREE(ff->dec);
+        ff->dec = bn_to_dec_str(ff->fib);
+        if (!ff->dec)
+            return -ENOMEM;
+        ff->dec_len = strlen(ff->dec);
+        ff->dec_k = ff->fib_k;
+        ff->timing.calc += ktime_to_ns(ktime_sub(ktime_get(), start));
+    }
+    *data = ff->dec;
+    *len = ff->dec_len;
+    return 0;
+}
+
+/* Chunked mode: hand out the next piece of F(*offset), computing it only
+ * when the held result is for another index.
+ */
+static ssize_t fib_read_chunk(struct fib_file *ff,
+                              char __user *buf,
+                              size_t size,
+                              loff_t *offset)
+{
+    if (!ff->fib_valid || ff->fib_k != *offset) {
+        fib_time_proxy(ff, *offset);
+        ff->chunk_pos = 0;
+    } else {
+        ff->timing.alloc = 0;
+        ff->timing.calc = 0;
+        ff->timing.allocs = 0;
+    }
+
+    const void *data;
+    size_t total;
+    int ret = fib_output(ff, &data, &total);
+    if (ret)
+        return ret;
+    size = min(size, total - ff->chunk_pos);
+    ktime_t copy_start = ktime_get();
+    if (copy_to_user(buf, (const char *) data + ff->chunk_pos, size))
+        return -EFAULT;
+    ff->timing.copy = ktime_to_ns(ktime_sub(ktime_get(), copy_start));
+    ff->chunk_pos += size;
+    return size;
+}
+
 /* calculate the fibonacci number at given offset */
 static ssize_t fib_read(struct file *file,
                         char *buf,
                         size_t size,
                         loff_t *offset)
 {
-    bn_t fib = BN_INITIALIZER;
-    fib_time_proxy(*offset, fib);
-    uint32_t len = fib->size;
-    // char *str_num = bn_to_dec_str(fib);
-    // pr_info("fibdrv: %lld %s\n", *offset, str_num);
-    size_t num_of_bytes = sizeof(uint64_t) * len / sizeof(char);
-    if (copy_to_user(buf, fib->digits, num_of_bytes)) {
-        printk(KERN_ALERT "fibdrv: copy_to_user failed\n");
-        return -EFAULT;
+    struct fib_file *ff = file->private_data;
+    bn *fib = ff->fib;
+    ssize_t ret;
+
+    /* pread() is not bound by fib_device_lseek(). */
+    if (*offset < 0 || *offset > MAX_LENGTH)
+        return 0;
+
+    fib_request_begin(FIB_STAT_READ, *offset);
+    mutex_lock(&ff->lock);
+    ktime_t start = ktime_get();
+    if (ff->mode & FIB_MODE_CHUNKED) {
+        ret = fib_read_chunk(ff, buf, size, offset);
+        ff->timing.k = *offset;
+        ff->timing.total = ktime_to_ns(ktime_sub(ktime_get(), start));
+        fib_request_done(FIB_STAT_READ, *offset, ff->timing.total,
+                         max_t(ssize_t, ret, 0));
+        mutex_unlock(&ff->lock);
+        return ret;
     }
-    bn_free(fib);
 
-    return (size_t) len;
+    bool stream = ff->mode & FIB_MODE_STREAM;
+    if (stream)
+        fib_stream(ff, *offset);
+    else
+        fib_time_proxy(ff, *offset);
+    const void *data;
+    size_t total;
+    if (fib_output(ff, &data, &total)) {
+        fib_request_done(FIB_STAT_READ, *offset,
+                         ktime_to_ns(ktime_sub(ktime_get(), start)), 0);
+        mutex_unlock(&ff->lock);
+        return -ENOMEM;
+    }
+    /* Never write past the caller's buffer; a return value larger than
+     * size / sizeof(uint64_t) (size in decimal mode) tells that the result
+     * was truncated.
+     */
+    size_t num_of_bytes = min(total, size);
+    ktime_t copy_start = ktime_get();
+    if (copy_to_user(buf, data, num_of_bytes)) {
+        printk(KERN_ALERT "fibdrv: copy_to_user failed\n");
+        ret = -EFAULT;
+        num_of_bytes = 0;
+    } else {
+        ret = ff->mode & FIB_MODE_DECIMAL ? total : fib->size;
+    }
+    ktime_t end = ktime_get();
+
+    ff->timing.k = *offset;
+    ff->timing.copy = ktime_to_ns(ktime_sub(end, copy_start));
+    ff->timing.total = ktime_to_ns(ktime_sub(end, start));
+    fib_request_done(FIB_STAT_READ, *offset, ff->timing.total, num_of_bytes);
+    if (stream && ret >= 0)
+        *offset += 1;
+    mutex_unlock(&ff->lock);
+    return ret;
 }
 
 /* write operation is skipped */
@@ -175,9 +414,459 @@ static ssize_t fib_write(struct file *file,
                          size_t size,
                          loff_t *offset)
 {
+    struct fib_file *ff = file->private_data;
+    ktime_t kt;
+
+    mutex_lock(&ff->lock);
+    kt = ff->kt;
+    mutex_unlock(&ff->lock);
     return ktime_to_ns(kt);
 }
 
+/* Store F(r->start), F(r->start+1), ... into the user buffer of @r, one
+ * bn_add apart, until r->count values are done or the buffer is full.
+ */
+static int fib_read_range(struct fib_range *r)
+{
+    char __user *buf = u64_to_user_ptr(r->buf);
+    int ret = 0;
+
+    r->done = 0;
+    r->bytes = 0;
+    if (r->start > MAX_LENGTH)
+        return -EINVAL;
+    r->count = min_t(uint64_t, r->count, MAX_LENGTH - r->start + 1);
+    if (!r->count)
+        return 0;
+
+    bn_t f0, f1, tmp, a;
+    bn_init(f0);
+    bn_init(f1);
+    bn_init(tmp);
+    bn_init(a);
+    fib_pair(r->start + 1, f0, f1, tmp, a); /* f0 = F(start) */
+    bn_free(tmp);
+    bn_free(a);
+
+    while (r->done < r->count) {
+        uint64_t len = f0->size;
+        size_t bytes = sizeof(len) + sizeof(uint64_t) * len;
+
+        if (r->size - r->bytes < bytes)
+            break;
+        if (copy_to_user(buf + r->bytes, &len, sizeof(len)) ||
+            copy_to_user(buf + r->bytes + sizeof(len), f0->digits,
+                         bytes - sizeof(len))) {
+            ret = -EFAULT;
+            break;
+        }
+        r->bytes += bytes;
+        r->done++;
+
+        bn_add(f0, f1, f0); /* f0 = F(k+2) */
+        bn_swap(f0, f1);    /* f0 = F(k+1), f1 = F(k+2) */
+        if (fatal_signal_pending(current))
+            break;
+        cond_resched();
+    }
+
+    bn_free(f0);
+    bn_free(f1);
+    if (!ret && !r->done)
+        ret = -ENOSPC;
+    return ret;
+}
+
+/* fib_batch_fn of FIB_IOC_BATCH: append the record of F(k) to the user
+ * buffer of the struct fib_batch at @arg.
+ */
+static int fib_batch_copy(void *arg, uint64_t k, const bn *fib)
+{
+    struct fib_batch *b = arg;
+    char __user *buf = u64_to_user_ptr(b->buf) + b->bytes;
+    struct fib_batch_entry e = {.k = k, .len = fib->size};
+    size_t bytes = sizeof(e) + sizeof(uint64_t) * e.len;
+
+    if (b->size - b->bytes < bytes)
+        return -ENOSPC;
+    if (copy_to_user(buf, &e, sizeof(e)) ||
+        copy_to_user(buf + sizeof(e), fib->digits, bytes - sizeof(e)))
+        return -EFAULT;
+    b->bytes += bytes;
+    b->done++;
+    if (fatal_signal_pending(current))
+        return -EINTR;
+    cond_resched();
+    return 0;
+}
+
+/* Store F(k) for the indices of @b into its user buffer, each computed from
+ * the ones before as fib_batch() plans, until all are done or the buffer is
+ * full.
+ */
+static int fib_read_batch(struct fib_batch *b)
+{
+    uint64_t *ks;
+    int ret = 0;
+
+    b->done = 0;
+    b->bytes = 0;
+    if (b->count > FIB_BATCH_MAX)
+        return -EINVAL;
+    if (!b->count)
+        return 0;
+    ks = kvmalloc_array(b->count, sizeof(*ks), GFP_KERNEL);
+    if (!ks)
+        return -ENOMEM;
+    if (copy_from_user(ks, u64_to_user_ptr(b->ks), sizeof(*ks) * b->count)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    for (uint64_t i = 0; i < b->count; i++) {
+        if ((i && ks[i] <= ks[i - 1]) || ks[i] > MAX_LENGTH) {
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    const uint64_t k = ks[b->count - 1];
+    ktime_t start = ktime_get();
+    fib_request_begin(FIB_STAT_BATCH, k);
+    ret = fib_batch(ks, b->count, fib_batch_copy, b);
+    /* Only the limbs count, as for read() and mmap, not the entries. */
+    fib_request_done(FIB_STAT_BATCH, k,
+                     ktime_to_ns(ktime_sub(ktime_get(), start)),
+                     b->bytes - sizeof(struct fib_batch_entry) * b->done);
+    if ((ret == -ENOSPC && b->done) || ret == -EINTR)
+        ret = 0;
+out:
+    kvfree(ks);
+    return ret;
+}
+
+static void fib_async_work(struct work_struct *work)
+{
+    struct fib_async *a = container_of(work, struct fib_async, work);
+    struct fib_file *ff = a->ff;
+    struct fib_timing timing;
+
+    fib_request_begin(FIB_STAT_ASYNC, a->k);
+    ktime_t start = ktime_get();
+    fib_lookup(a->k, a->fib, &timing);
+    a->ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    fib_request_done(FIB_STAT_ASYNC, a->k, a->ns, 0);
+
+    mutex_lock(&ff->async_lock);
+    a->ready = true;
+    ff->async_ready++;
+    mutex_unlock(&ff->async_lock);
+    wake_up_interruptible(&ff->async_wait);
+}
+
+/* Return the request of @ff tagged @tag, with ff->async_lock held. */
+static struct fib_async *fib_async_find(struct fib_file *ff, uint64_t tag)
+{
+    struct fib_async *a;
+
+    list_for_each_entry(a, &ff->async, node) {
+        if (a->tag == tag)
+            return a;
+    }
+    return NULL;
+}
+
+static int fib_async_submit(struct fib_file *ff, const struct fib_submit *s)
+{
+    struct fib_async *a;
+    int ret = 0;
+
+    if (s->k > MAX_LENGTH)
+        return -EINVAL;
+    /* Zeroed memory is a valid BN_INITIALIZER for a->fib. */
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+        return -ENOMEM;
+    a->ff = ff;
+    a->tag = s->tag;
+    a->k = s->k;
+    INIT_WORK(&a->work, fib_async_work);
+
+    mutex_lock(&ff->async_lock);
+    if (ff->async_nr >= READ_ONCE(async_max)) {
+        ret = -EAGAIN;
+    } else if (fib_async_find(ff, s->tag)) {
+        ret = -EEXIST;
+    } else {
+        list_add_tail(&a->node, &ff->async);
+        ff->async_nr++;
+        queue_work(fib_wq, &a->work);
+    }
+    mutex_unlock(&ff->async_lock);
+    if (ret)
+        kfree(a);
+    return ret;
+}
+
+static int fib_async_collect(struct fib_file *ff, struct fib_collect *c)
+{
+    struct fib_async *a = NULL, *it;
+    int ret = 0;
+
+    mutex_lock(&ff->async_lock);
+    if (c->flags & FIB_COLLECT_ANY) {
+        list_for_each_entry(it, &ff->async, node) {
+            if (it->ready) {
+                a = it;
+                break;
+            }
+        }
+        if (!a)
+            ret = ff->async_nr ? -EAGAIN : -ENOENT;
+    } else {
+        a = fib_async_find(ff, c->tag);
+        if (!a)
+            ret = -ENOENT;
+        else if (!a->ready)
+            ret = -EAGAIN;
+    }
+    if (ret)
+        goto out;
+
+    c->tag = a->tag;
+    c->k = a->k;
+    c->len = a->fib->size;
+    c->ns = a->ns;
+    if (c->size < sizeof(uint64_t) * a->fib->size) {
+        ret = -ENOSPC;
+        goto out;
+    }
+    if (copy_to_user(u64_to_user_ptr(c->buf), a->fib->digits,
+                     sizeof(uint64_t) * a->fib->size)) {
+        ret = -EFAULT;
+        goto out;
+    }
+    fib_stats_copied(sizeof(uint64_t) * a->fib->size);
+    list_del(&a->node);
+    ff->async_nr--;
+    ff->async_ready--;
+    fib_async_free(a);
+out:
+    mutex_unlock(&ff->async_lock);
+    if (!ret)
+        wake_up_interruptible(&ff->async_wait); /* room for one more */
+    return ret;
+}
+
+static __poll_t fib_poll(struct file *file, poll_table *wait)
+{
+    struct fib_file *ff = file->private_data;
+    __poll_t mask = 0;
+
+    poll_wait(file, &ff->async_wait, wait);
+    mutex_lock(&ff->async_lock);
+    if (ff->async_ready)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ff->async_nr < READ_ONCE(async_max))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    mutex_unlock(&ff->async_lock);
+    return mask;
+}
+
+/* Compute F(k) and publish it in the mmap() area of @ff, with ff->lock
+ * held.
+ */
+static int fib_mmap_compute(struct fib_file *ff, uint64_t k)
+{
+    if (k > MAX_LENGTH)
+        return -EINVAL;
+
+    fib_time_proxy(ff, k);
+
+    mutex_lock(&ff->map_lock);
+    struct fib_mmap_header *hdr = ff->map;
+    if (!hdr) {
+        mutex_unlock(&ff->map_lock);
+        return -ENXIO;
+    }
+    size_t bytes = sizeof(uint64_t) * ff->fib->size;
+    bool fits = bytes <= ff->map_size - FIB_MMAP_DATA_OFFSET;
+
+    /* Sequence count of struct fib_mmap_header: odd while the area is
+     * written, published as even once it is consistent again.
+     */
+    const uint64_t seq = hdr->seq;
+    WRITE_ONCE(hdr->seq, seq + 1);
+    smp_wmb();
+    WRITE_ONCE(hdr->k, k);
+    WRITE_ONCE(hdr->len, ff->fib->size);
+    WRITE_ONCE(hdr->ns, ktime_to_ns(ff->kt));
+    if (fits)
+        memcpy((char *) ff->map + FIB_MMAP_DATA_OFFSET, ff->fib->digits,
+               bytes);
+    smp_store_release(&hdr->seq, seq + 2);
+    mutex_unlock(&ff->map_lock);
+    return fits ? 0 : -EOVERFLOW;
+}
+
+static long fib_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct fib_file *ff = file->private_data;
+    struct fib_timing timing;
+    struct fib_range range;
+    struct fib_submit submit;
+    struct fib_collect collect;
+    struct fib_batch batch;
+    uint32_t mode;
+    const void *data;
+    size_t length;
+    ktime_t start;
+    uint64_t k;
+    int ret;
+
+    switch (cmd) {
+    case FIB_IOC_GET_TIMING:
+        mutex_lock(&ff->lock);
+        timing = ff->timing;
+        mutex_unlock(&ff->lock);
+        if (copy_to_user((void __user *) arg, &timing, sizeof(timing)))
+            return -EFAULT;
+        return 0;
+    case FIB_IOC_SET_MODE:
+        if (get_user(mode, (uint32_t __user *) arg))
+            return -EFAULT;
+        if ((mode &
+             ~(FIB_MODE_STREAM | FIB_MODE_CHUNKED | FIB_MODE_DECIMAL)) ||
+            ((mode & FIB_MODE_STREAM) && (mode & FIB_MODE_CHUNKED)))
+            return -EINVAL;
+        mutex_lock(&ff->lock);
+        ff->mode = mode;
+        ff->chunk_pos = 0;
+        mutex_unlock(&ff->lock);
+        return 0;
+    case FIB_IOC_GET_LENGTH:
+        mutex_lock(&ff->lock);
+        fib_time_proxy(ff, file->f_pos);
+        ff->chunk_pos = 0;
+        ret = fib_output(ff, &data, &length);
+        mutex_unlock(&ff->lock);
+        if (ret)
+            return ret;
+        return put_user((uint64_t) length, (uint64_t __user *) arg);
+    case FIB_IOC_MMAP_COMPUTE:
+        if (get_user(k, (uint64_t __user *) arg))
+            return -EFAULT;
+        fib_request_begin(FIB_STAT_MMAP, k);
+        mutex_lock(&ff->lock);
+        start = ktime_get();
+        ret = fib_mmap_compute(ff, k);
+        fib_request_done(FIB_STAT_MMAP, k,
+                         ktime_to_ns(ktime_sub(ktime_get(), start)),
+                         ret ? 0 : sizeof(uint64_t) * ff->fib->size);
+        mutex_unlock(&ff->lock);
+        return ret;
+    case FIB_IOC_READ_RANGE:
+        if (copy_from_user(&range, (void __user *) arg, sizeof(range)))
+            return -EFAULT;
+        fib_request_begin(FIB_STAT_RANGE, range.start);
+        start = ktime_get();
+        ret = fib_read_range(&range);
+        /* Only the limbs count, as for read() and mmap, not the lengths. */
+        fib_request_done(FIB_STAT_RANGE, range.start,
+                         ktime_to_ns(ktime_sub(ktime_get(), start)),
+                         range.bytes - sizeof(uint64_t) * range.done);
+        if (ret != -EFAULT &&
+            copy_to_user((void __user *) arg, &range, sizeof(range)))
+            return -EFAULT;
+        return ret;
+    case FIB_IOC_SUBMIT:
+        if (copy_from_user(&submit, (void __user *) arg, sizeof(submit)))
+            return -EFAULT;
+        return fib_async_submit(ff, &submit);
+    case FIB_IOC_COLLECT:
+        if (copy_from_user(&collect, (void __user *) arg, sizeof(collect)))
+            return -EFAULT;
+        ret = fib_async_collect(ff, &collect);
+        if ((!ret || ret == -ENOSPC) &&
+            copy_to_user((void __user *) arg, &collect, sizeof(collect)))
+            return -EFAULT;
+        return ret;
+    case FIB_IOC_BATCH:
+        if (copy_from_user(&batch, (void __user *) arg, sizeof(batch)))
+            return -EFAULT;
+        ret = fib_read_batch(&batch);
+        if (ret != -EFAULT &&
+            copy_to_user((void __user *) arg, &batch, sizeof(batch)))
+            return -EFAULT;
+        return ret;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static void fib_vma_open(struct vm_area_struct *vma)
+{
+    struct fib_file *ff = vma->vm_private_data;
+
+    mutex_lock(&ff->map_lock);
+    ff->map_users++;
+    mutex_unlock(&ff->map_lock);
+}
+
+static void fib_vma_close(struct vm_area_struct *vma)
+{
+    struct fib_file *ff = vma->vm_private_data;
+
+    mutex_lock(&ff->map_lock);
+    ff->map_users--;
+    mutex_unlock(&ff->map_lock);
+}
+
+static const struct vm_operations_struct fib_vm_ops = {
+    .open = fib_vma_open,
+    .close = fib_vma_close,
+};
+
+/* Map the per-file result area, sized by the first mapping. Once every
+ * mapping is gone a new one may choose a different size.
+ */
+static int fib_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct fib_file *ff = file->private_data;
+    size_t size = vma->vm_end - vma->vm_start;
+    int ret = 0;
+
+    if (vma->vm_pgoff || size > (size_t) READ_ONCE(mmap_max_kb) * 1024)
+        return -EINVAL;
+
+    mutex_lock(&ff->map_lock);
+    if (ff->map && ff->map_size != size) {
+        if (ff->map_users) {
+            ret = -EBUSY;
+            goto out;
+        }
+        vfree(ff->map);
+        ff->map = NULL;
+    }
+    if (!ff->map) {
+        ff->map = vmalloc_user(size);
+        if (!ff->map) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        ff->map_size = size;
+    }
+
+    ret = remap_vmalloc_range(vma, ff->map, 0);
+    if (!ret) {
+        vma->vm_private_data = ff;
+        vma->vm_ops = &fib_vm_ops;
+        ff->map_users++; /* ->open() is not called for this first mapping */
+    }
+out:
+    mutex_unlock(&ff->map_lock);
+    return ret;
+}
+
 static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
 {
     loff_t new_pos = 0;
@@ -198,6 +887,12 @@ static loff_t fib_device_lseek(struct file *file, loff_t offset, int orig)
     if (new_pos < 0)
         new_pos = 0;        // min case
     file->f_pos = new_pos;  // This is what we'll use now
+
+    /* Chunked reads restart from the first byte of the number. */
+    struct fib_file *ff = file->private_data;
+    mutex_lock(&ff->lock);
+    ff->chunk_pos = 0;
+    mutex_unlock(&ff->lock);
     return new_pos;
 }
 
@@ -208,6 +903,10 @@ const struct file_operations fib_fops = {
     .open = fib_open,
     .release = fib_release,
     .llseek = fib_device_lseek,
+    .unlocked_ioctl = fib_ioctl,
+    .mmap = fib_mmap,
+    .poll = fib_poll,
+    .compat_ioctl = compat_ptr_ioctl,
 };
 
 static int __init init_fib_dev(void)
@@ -215,6 +914,29 @@ static int __init init_fib_dev(void)
     int rc = 0;
     mutex_init(&fib_mutex);
 
+    printk(KERN_INFO "fibdrv: %s digit loops\n",
+           bn_cpu_init(adx) ? "ADX" : "generic");
+    fib_wq = alloc_workqueue("fibdrv", WQ_UNBOUND, 0);
+    if (!fib_wq) {
+        rc = -ENOMEM;
+        goto failed_wq;
+    }
+
+    /* Everything a request may use is set up before the device appears. */
+    fib_debugfs = debugfs_create_dir(DEV_FIBONACCI_NAME, NULL);
+    rc = mem_pool_init(fib_debugfs);
+    if (rc)
+        goto failed_init;
+    rc = fib_cache_init(fib_debugfs);
+    if (rc)
+        goto failed_init;
+    rc = fib_ckpt_init(fib_debugfs);
+    if (rc)
+        goto failed_init;
+    rc = fib_stats_init(fib_debugfs);
+    if (rc)
+        goto failed_init;
+
     // Let's register the device
     // This will dynamically allocate the major number
     rc = major = register_chrdev(major, DEV_FIBONACCI_NAME, &fib_fops);
@@ -238,21 +960,38 @@ static int __init init_fib_dev(void)
         rc = -4;
         goto failed_device_create;
     }
-    return rc;
+    return 0;
 failed_device_create:
     class_destroy(fib_class);
 failed_class_create:
-failed_cdev:
     unregister_chrdev(major, DEV_FIBONACCI_NAME);
+failed_cdev:
+failed_init:
+    /* The files that show the stores go first. The exit functions also
+     * undo a partial init, or none at all.
+     */
+    debugfs_remove_recursive(fib_debugfs);
+    fib_ckpt_exit();
+    fib_cache_exit();
+    mem_pool_exit();
+    destroy_workqueue(fib_wq);
+failed_wq:
+    bn_cpu_exit();
     return rc;
 }
 
 static void __exit exit_fib_dev(void)
 {
-    mutex_destroy(&fib_mutex);
     device_destroy(fib_class, fib_dev);
     class_destroy(fib_class);
     unregister_chrdev(major, DEV_FIBONACCI_NAME);
+    debugfs_remove_recursive(fib_debugfs);
+    fib_ckpt_exit();
+    fib_cache_exit();
+    mem_pool_exit();
+    mutex_destroy(&fib_mutex);
+    destroy_workqueue(fib_wq);
+    bn_cpu_exit();
 }
 
 module_init(init_fib_dev);
@@ -0,0 +1,156 @@
+#ifndef FIBDRV_H
+#define FIBDRV_H
+
+/* Interface shared by the fibdrv module and its userspace clients. */
+
+#ifdef __KERNEL__
+#include <linux/ioctl.h>
+#include <linux/types.h>
+#else
+#include <stdint.h>
+#include <sys/ioctl.h>
+#endif
+
+/* Breakdown of the last read() on an open file, all times in nanoseconds. */
+struct fib_timing {
+    uint64_t k;     /* index that was read */
+    uint64_t alloc; /* setting up and tearing down the working numbers */
+    uint64_t calc;  /* fast-doubling loop */
+    uint64_t copy;  /* copy_to_user */
+    uint64_t total; /* whole read(), including the above */
+    /* Allocator calls made while computing the number, on whichever CPUs,
+     * and by this computation only.
+     */
+    uint64_t allocs;
+};
+
+/* Argument of FIB_IOC_READ_RANGE. The buffer receives one record per value
+ * of F(start), F(start+1), ...: a uint64_t limb count followed by that many
+ * uint64_t limbs, least significant first. Filling stops at the first record
+ * that does not fit, so 'done' may be less than 'count'; continue from
+ * start + done to fetch the rest.
+ */
+struct fib_range {
+    uint64_t start; /* in: first index */
+    uint64_t count; /* in: number of values wanted */
+    uint64_t buf;   /* in: address of the user buffer */
+    uint64_t size;  /* in: size of the user buffer in bytes */
+    uint64_t done;  /* out: number of values stored */
+    uint64_t bytes; /* out: bytes of the buffer used */
+};
+
+/* Argument of FIB_IOC_BATCH, which computes F(k) for a list of indices in
+ * one pass. The buffer receives one record per index, in the order of 'ks':
+ * a struct fib_batch_entry followed by 'len' uint64_t limbs, least
+ * significant first. Filling stops at the first record that does not fit,
+ * so 'done' may be less than 'count'; continue from the index at 'done'.
+ */
+struct fib_batch {
+    uint64_t ks;    /* in: address of the indices, strictly increasing */
+    uint64_t count; /* in: number of indices, at most FIB_BATCH_MAX */
+    uint64_t buf;   /* in: address of the user buffer */
+    uint64_t size;  /* in: size of the user buffer in bytes */
+    uint64_t done;  /* out: number of records stored */
+    uint64_t bytes; /* out: bytes of the buffer used */
+};
+
+struct fib_batch_entry {
+    uint64_t k;   /* index of the record */
+    uint64_t len; /* limbs of F(k) that follow */
+};
+
+#define FIB_BATCH_MAX 4096
+
+/* Layout of the area mapped with mmap() on the device: this header, then
+ * 'len' limbs of F(k) starting at byte FIB_MMAP_DATA_OFFSET. The area is
+ * filled by FIB_IOC_MMAP_COMPUTE under a sequence count: 'seq' turns odd
+ * before anything else changes and, once the header and limbs are
+ * complete, becomes the next even number with release ordering. The
+ * caller of the ioctl may read the area as soon as it returns. Another
+ * thread reading it meanwhile loads 'seq' with acquire ordering and waits
+ * while it is odd, copies what it needs, then loads 'seq' again after a
+ * read barrier and starts over if it has changed.
+ */
+struct fib_mmap_header {
+    uint64_t seq; /* twice the calls made so far, plus one during a call */
+    uint64_t k;   /* index of the result */
+    uint64_t len; /* limbs of F(k); may exceed the area on -EOVERFLOW */
+    uint64_t ns;  /* time spent computing F(k) */
+};
+
+#define FIB_MMAP_DATA_OFFSET 64
+
+/* Argument of FIB_IOC_SUBMIT. The tag names the request until it is
+ * collected and must not be in use by another one of the same file.
+ */
+struct fib_submit {
+    uint64_t tag; /* in: caller's name for the request */
+    uint64_t k;   /* in: index to compute */
+};
+
+/* Argument of FIB_IOC_COLLECT. The limbs of F(k) are stored least
+ * significant first. If they do not fit, ENOSPC is returned with 'len' set
+ * and the result is kept for another try.
+ */
+struct fib_collect {
+    uint64_t tag;   /* in: request to collect; out with FIB_COLLECT_ANY */
+    uint64_t flags; /* in: FIB_COLLECT_* */
+    uint64_t buf;   /* in: address of the user buffer */
+    uint64_t size;  /* in: size of the user buffer in bytes */
+    uint64_t k;     /* out: index of the result */
+    uint64_t len;   /* out: limbs of F(k) */
+    uint64_t ns;    /* out: time spent computing F(k) */
+};
+
+/* Collect whichever computed request was submitted first, ignoring 'tag'. */
+#define FIB_COLLECT_ANY (1U << 0)
+
+/* Flags of FIB_IOC_SET_MODE. Without any, read() stores as many limbs of
+ * F(offset) as fit in the buffer and returns the full limb count.
+ * FIB_MODE_DECIMAL replaces the limbs by the decimal digits of the number,
+ * without a terminating NUL, for read() and FIB_IOC_GET_LENGTH; read() then
+ * returns the full string length. It combines with either of the others.
+ */
+#define FIB_MODE_STREAM (1U << 0)  /* read() returns F(k) and moves to k+1 */
+#define FIB_MODE_CHUNKED (1U << 1) /* read() returns bytes of F(offset) */
+#define FIB_MODE_DECIMAL (1U << 2) /* read() returns F(offset) in decimal */
+
+#define FIB_IOC_MAGIC 'f'
+
+/* Fetch the struct fib_timing of the caller's file. */
+#define FIB_IOC_GET_TIMING _IOR(FIB_IOC_MAGIC, 1, struct fib_timing)
+/* Set the FIB_MODE_* flags of the caller's file. */
+#define FIB_IOC_SET_MODE _IOW(FIB_IOC_MAGIC, 2, uint32_t)
+/* Fill a buffer with consecutive numbers, see struct fib_range. */
+#define FIB_IOC_READ_RANGE _IOWR(FIB_IOC_MAGIC, 3, struct fib_range)
+/* Compute F(offset), keep it for chunked reads and return its size in bytes.
+ * In FIB_MODE_CHUNKED, read() then hands out successive pieces of that
+ * result, returning 0 once all of it has been read; lseek() starts over.
+ */
+#define FIB_IOC_GET_LENGTH _IOR(FIB_IOC_MAGIC, 4, uint64_t)
+/* Compute F(k) straight into the caller's mmap() area. Fails with EOVERFLOW,
+ * setting only the header, when the result does not fit in the area.
+ */
+#define FIB_IOC_MMAP_COMPUTE _IOW(FIB_IOC_MAGIC, 5, uint64_t)
+/* Queue F(k) for computation in the background and return at once. Fails
+ * with EAGAIN while async_max requests of the file are uncollected, and with
+ * EEXIST if the tag is one of them. poll() reports POLLIN once a result can
+ * be collected and POLLOUT while another request can be submitted.
+ */
+#define FIB_IOC_SUBMIT _IOW(FIB_IOC_MAGIC, 6, struct fib_submit)
+/* Fetch a computed result and forget the request. Fails with EAGAIN while
+ * it is being computed and with ENOENT if there is no such request; with
+ * FIB_COLLECT_ANY, with EAGAIN if none is computed yet and with ENOENT if
+ * none is pending at all.
+ */
+#define FIB_IOC_COLLECT _IOWR(FIB_IOC_MAGIC, 7, struct fib_collect)
+/* Fill a buffer with F(k) for every index of a sorted list, see struct
+ * fib_batch. Each index is reached from the one before by the addition
+ * formula when they are close, or else by fast doubling that resumes from
+ * the leading bits it shares with the last doubled index. Fails with EINVAL
+ * if the list is not strictly increasing or goes past the largest index the
+ * driver serves, and with ENOSPC if not even the first record fits.
+ */
+#define FIB_IOC_BATCH _IOWR(FIB_IOC_MAGIC, 8, struct fib_batch)
+
+#endif /* FIBDRV_H */
@@ -0,0 +1,271 @@
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/xarray.h>
+
+#include "mem.h"
+
+/* Size class c holds buffers of MEM_POOL_MIN << c bytes, header included. */
+#define MEM_POOL_MIN 64
+#define MEM_POOL_CLASSES 11 /* up to 64 KiB */
+#define MEM_POOL_MAX_DEPTH 64
+
+static unsigned int pool_depth = 16;
+module_param(pool_depth, uint, 0444);
+MODULE_PARM_DESC(pool_depth,
+                 "Free buffers kept per CPU and size class (0: no pooling)");
+
+static bool pool_kmem_cache = true;
+module_param(pool_kmem_cache, bool, 0444);
+MODULE_PARM_DESC(pool_kmem_cache, "Back the size classes with kmem_caches");
+
+/* Placed in front of every buffer, which keeps the data 16-byte aligned. */
+struct mem_hdr {
+    uint32_t cls;    /* size class, MEM_POOL_CLASSES if not pooled */
+    uint32_t cached; /* allocated from mem_caches[cls] */
+    uint64_t size;   /* usable bytes after the header */
+};
+
+struct mem_pool {
+    unsigned int count[MEM_POOL_CLASSES];
+    struct mem_hdr *free[MEM_POOL_CLASSES][MEM_POOL_MAX_DEPTH];
+    unsigned long hits;   /* allocations served from the free lists */
+    unsigned long misses; /* allocations passed to the backing store */
+};
+
+DEFINE_PER_CPU(unsigned long, mem_allocs);
+DEFINE_PER_CPU(unsigned long, mem_bytes);
+static DEFINE_PER_CPU(struct mem_pool, mem_pools);
+static DEFINE_XARRAY(mem_counters); /* struct mem_counter by PID */
+static struct kmem_cache *mem_caches[MEM_POOL_CLASSES];
+static char mem_cache_names[MEM_POOL_CLASSES][24];
+
+unsigned long mem_alloc_count(void)
+{
+    unsigned long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu(mem_allocs, cpu);
+    return sum;
+}
+
+unsigned long mem_alloc_bytes(void)
+{
+    unsigned long sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += per_cpu(mem_bytes, cpu);
+    return sum;
+}
+
+struct mem_counter *mem_count_get(void)
+{
+    return xa_load(&mem_counters, task_pid_nr(current));
+}
+
+void mem_count_set(struct mem_counter *c)
+{
+    if (c)
+        xa_store(&mem_counters, task_pid_nr(current), c, GFP_KERNEL);
+    else
+        xa_erase(&mem_counters, task_pid_nr(current));
+}
+
+void mem_count_begin(struct mem_counter *c)
+{
+    atomic_long_set(&c->allocs, 0);
+    mem_count_set(c);
+}
+
+unsigned long mem_count_end(struct mem_counter *c)
+{
+    mem_count_set(NULL);
+    return atomic_long_read(&c->allocs);
+}
+
+void mem_count_inc(void)
+{
+    struct mem_counter *c = mem_count_get();
+    if (c)
+        atomic_long_inc(&c->allocs);
+}
+
+static size_t mem_class_bytes(unsigned int cls)
+{
+    return (size_t) MEM_POOL_MIN << cls;
+}
+
+/* Return the smallest class fitting @size bytes of data, or
+ * MEM_POOL_CLASSES if none does.
+ */
+static unsigned int mem_class(size_t size)
+{
+    unsigned int cls = 0;
+    while (cls < MEM_POOL_CLASSES &&
+           mem_class_bytes(cls) - sizeof(struct mem_hdr) < size)
+        cls++;
+    return cls;
+}
+
+static struct mem_hdr *mem_backend_alloc(unsigned int cls)
+{
+    struct kmem_cache *cache = READ_ONCE(mem_caches[cls]);
+    struct mem_hdr *h;
+
+    if (cache)
+        h = kmem_cache_alloc(cache, GFP_KERNEL);
+    else
+        h = kmalloc(mem_class_bytes(cls), GFP_KERNEL);
+    if (h)
+        h->cached = !!cache;
+    return h;
+}
+
+static void mem_backend_free(struct mem_hdr *h)
+{
+    if (h->cached)
+        kmem_cache_free(mem_caches[h->cls], h);
+    else
+        kfree(h);
+}
+
+void *mem_alloc(size_t size)
+{
+    const unsigned int cls = mem_class(size);
+    struct mem_hdr *h = NULL;
+
+    /* Larger buffers, such as NTT scratch, may need more contiguous pages
+     * than a fragmented system has, so fall back to vmalloc() for them.
+     */
+    if (cls == MEM_POOL_CLASSES) {
+        h = kvmalloc(sizeof(*h) + size, GFP_KERNEL);
+        if (!h)
+            return NULL;
+        h->cls = cls;
+        h->cached = 0;
+        h->size = size;
+        return h + 1;
+    }
+
+    struct mem_pool *pool = get_cpu_ptr(&mem_pools);
+    if (pool->count[cls]) {
+        h = pool->free[cls][--pool->count[cls]];
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    put_cpu_ptr(&mem_pools);
+
+    if (!h) {
+        h = mem_backend_alloc(cls);
+        if (!h)
+            return NULL;
+        h->cls = cls;
+        h->size = mem_class_bytes(cls) - sizeof(*h);
+    }
+    return h + 1;
+}
+
+void *mem_realloc(void *ptr, size_t size)
+{
+    if (!ptr)
+        return mem_alloc(size);
+
+    /* Classes are rounded up, so growing often fits in place. */
+    struct mem_hdr *h = (struct mem_hdr *) ptr - 1;
+    if (size <= h->size)
+        return ptr;
+
+    void *p = mem_alloc(size);
+    if (!p)
+        return NULL;
+    memcpy(p, ptr, h->size);
+    mem_free(ptr);
+    return p;
+}
+
+void mem_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    struct mem_hdr *h = (struct mem_hdr *) ptr - 1;
+    if (h->cls < MEM_POOL_CLASSES) {
+        struct mem_pool *pool = get_cpu_ptr(&mem_pools);
+        if (pool->count[h->cls] < pool_depth) {
+            pool->free[h->cls][pool->count[h->cls]++] = h;
+            h = NULL;
+        }
+        put_cpu_ptr(&mem_pools);
+        if (!h)
+            return;
+        mem_backend_free(h);
+        return;
+    }
+    kvfree(h);
+}
+
+static int mem_pool_show(struct seq_file *m, void *v)
+{
+    unsigned long hits = 0, misses = 0;
+    int cpu;
+
+    seq_puts(m, "class bytes cached\n");
+    for (unsigned int cls = 0; cls < MEM_POOL_CLASSES; cls++) {
+        unsigned long cached = 0;
+        for_each_possible_cpu(cpu)
+            cached += READ_ONCE(per_cpu(mem_pools, cpu).count[cls]);
+        seq_printf(m, "%5u %5zu %6lu\n", cls, mem_class_bytes(cls), cached);
+    }
+    for_each_possible_cpu(cpu) {
+        hits += READ_ONCE(per_cpu(mem_pools, cpu).hits);
+        misses += READ_ONCE(per_cpu(mem_pools, cpu).misses);
+    }
+    seq_printf(m, "hits: %lu\n", hits);
+    seq_printf(m, "misses: %lu\n", misses);
+    seq_printf(m, "hit rate: %lu%%\n",
+               hits + misses ? hits * 100 / (hits + misses) : 0);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mem_pool);
+
+int mem_pool_init(struct dentry *dir)
+{
+    pool_depth = min(pool_depth, (unsigned int) MEM_POOL_MAX_DEPTH);
+    /* Classes without a cache, should creating it fail, use kmalloc(). */
+    for (unsigned int cls = 0; cls < MEM_POOL_CLASSES; cls++) {
+        if (!pool_kmem_cache)
+            break;
+        snprintf(mem_cache_names[cls], sizeof(mem_cache_names[cls]),
+                 "fibdrv_bn_%zu", mem_class_bytes(cls));
+        WRITE_ONCE(mem_caches[cls],
+                   kmem_cache_create(mem_cache_names[cls],
+                                     mem_class_bytes(cls), 0, 0, NULL));
+    }
+    debugfs_create_file("pool", 0444, dir, NULL, &mem_pool_fops);
+    return 0;
+}
+
+/* Release every pooled buffer; called once nothing allocates any more. */
+void mem_pool_exit(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        struct mem_pool *pool = per_cpu_ptr(&mem_pools, cpu);
+        for (unsigned int cls = 0; cls < MEM_POOL_CLASSES; cls++) {
+            while (pool->count[cls])
+                mem_backend_free(pool->free[cls][--pool->count[cls]]);
+        }
+    }
+    for (unsigned int cls = 0; cls < MEM_POOL_CLASSES; cls++) {
+        kmem_cache_destroy(mem_caches[cls]);
+        mem_caches[cls] = NULL;
+    }
+}
@@ -1,16 +1,93 @@
 #ifndef MEM_H
 #define MEM_H
 
+#ifndef __KERNEL__
+/* Userspace build of the tests and benchmarks: plain libc allocation. */
+#include <stdlib.h>
+
+#define MALLOC(n) malloc(n)
+#define REALLOC(p, n) realloc(p, n)
+#define FREE(p) free(p)
+
+/* Allocator calls are not counted here. */
+struct mem_counter {
+    unsigned long allocs;
+};
+
+static inline void mem_count_begin(struct mem_counter *c)
+{
+    c->allocs = 0;
+}
+
+static inline unsigned long mem_count_end(struct mem_counter *c)
+{
+    return c->allocs;
+}
+#else
+#include <linux/percpu.h>
 #include <linux/slab.h>
 #include <linux/string.h>
 #include <linux/types.h>
 
+struct dentry;
+
+/* Calls into the allocator made through MALLOC() and REALLOC(), and the
+ * bytes they asked for, counted per CPU so that the hot path never bounces
+ * a shared cache line.
+ */
+DECLARE_PER_CPU(unsigned long, mem_allocs);
+DECLARE_PER_CPU(unsigned long, mem_bytes);
+
+/* Return the number of allocator calls made so far on all CPUs. */
+unsigned long mem_alloc_count(void);
+
+/* Return the bytes asked for by them. */
+unsigned long mem_alloc_bytes(void);
+
+/* Allocator calls of one computation, whichever CPUs it runs on:
+ * mem_count_begin() attaches @c to the current task, and mem_count_end()
+ * detaches it and returns the calls made in between by this task and by
+ * the tasks its products were split to, never those of other computations.
+ * Calls go uncounted should attaching fail for lack of memory.
+ */
+struct mem_counter {
+    atomic_long_t allocs;
+};
+
+void mem_count_begin(struct mem_counter *c);
+unsigned long mem_count_end(struct mem_counter *c);
+
+/* Return the counter attached to the current task, or NULL, and attach
+ * @c, or none if NULL, for work done on behalf of another task.
+ */
+struct mem_counter *mem_count_get(void);
+void mem_count_set(struct mem_counter *c);
+void mem_count_inc(void);
+
+/* Pooled allocator behind MALLOC(), REALLOC() and FREE(). Buffers of up to
+ * 64 KiB are rounded to power-of-two size classes and recycled through
+ * per-CPU free lists, so that steady-state requests stop reaching the slab
+ * allocator; the backing store of every class is a kmem_cache when the
+ * pool_kmem_cache parameter is set, kmalloc() otherwise. Larger buffers
+ * come from kvmalloc(). Memory from these functions must only be released
+ * with mem_free().
+ */
+int mem_pool_init(struct dentry *dir);
+void mem_pool_exit(void);
+
+void *mem_alloc(size_t size);
+void *mem_realloc(void *ptr, size_t size);
+void mem_free(void *ptr);
+
 // allocates memory for a bn struct
 static inline void *mykmalloc(size_t size)
 {
     void *p;
-    if (!(p = kmalloc(size, GFP_KERNEL))) {
-        printk(KERN_ERR "mykmalloc: kmalloc failed\n");
+    this_cpu_inc(mem_allocs);
+    this_cpu_add(mem_bytes, size);
+    mem_count_inc();
+    if (!(p = mem_alloc(size))) {
+        printk(KERN_ERR "mykmalloc: mem_alloc failed\n");
         return NULL;
     }
     return p;
@@ -20,8 +97,11 @@ static inline void *mykmalloc(size_t size)
 static inline void *mykrealloc(void *ptr, size_t size)
 {
     void *p;
-    if (!(p = krealloc(ptr, size, GFP_KERNEL))) {
-        printk(KERN_ERR "mykrealloc: krealloc failed\n");
+    this_cpu_inc(mem_allocs);
+    this_cpu_add(mem_bytes, size);
+    mem_count_inc();
+    if (!(p = mem_realloc(ptr, size))) {
+        printk(KERN_ERR "mykrealloc: mem_realloc failed\n");
         return NULL;
     }
     return p;
@@ -30,11 +110,12 @@ static inline void *mykrealloc(void *ptr, size_t size)
 // frees memory for a bn struct
 static inline void mykfree(void *ptr)
 {
-    kfree(ptr);
+    mem_free(ptr);
 }
 
 #define MALLOC(n) mykmalloc(n)
 #define REALLOC(p, n) mykrealloc(p, n)
 #define FREE(p) mykfree(p)
+#endif /* !__KERNEL__ */
 
 #endif /* MEM_H */
@@ -0,0 +1,217 @@
+/* Time fib_bignum(), which the driver runs for every request it computes
+ * (here without checkpoints), bn_mul() and bn_sqr() of libfibbn across
+ * operand sizes, with the cycle and instruction counts of the perf counters
+ * where the kernel lets us open them (see perf_event_paranoid), "-"
+ * otherwise, then fib_batch() of sparse indices against fib_bignum() of
+ * each.
+ */
+#define _GNU_SOURCE
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bn.h"
+#include "fib.h"
+
+#define MIN_RUN_NS 50000000LL /* per operation and size */
+#define BATCH_STEP 1000        /* fib_batch() of BATCH_STEP * i, ... */
+#define BATCH_COUNT 200        /* ... for i = 1..BATCH_COUNT */
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Cycles and instructions of this thread in user mode, which the default
+ * perf_event_paranoid of 2 allows, read together as one group.
+ */
+static int perf_fd = -1;
+
+static void perf_open(void)
+{
+    const uint64_t configs[] = {PERF_COUNT_HW_CPU_CYCLES,
+                                PERF_COUNT_HW_INSTRUCTIONS};
+
+    for (int i = 0; i < 2; i++) {
+        struct perf_event_attr attr = {
+            .type = PERF_TYPE_HARDWARE,
+            .size = sizeof(attr),
+            .config = configs[i],
+            .disabled = !i,
+            .exclude_kernel = 1,
+            .exclude_hv = 1,
+            .read_format = PERF_FORMAT_GROUP,
+        };
+        int fd = syscall(SYS_perf_event_open, &attr, 0, -1, perf_fd, 0);
+        if (fd < 0) {
+            if (perf_fd >= 0)
+                close(perf_fd);
+            perf_fd = -1;
+            return;
+        }
+        if (!i)
+            perf_fd = fd;
+    }
+}
+
+struct sample {
+    double ns;
+    double cycles; /* < 0 without perf counters */
+    double instructions;
+};
+
+enum op { FIB, MUL, SQR };
+
+static const char *const op_names[] = {"fib_bignum", "bn_mul", "bn_sqr"};
+
+static void bn_random(bn *p, uint32_t size)
+{
+    bn_reserve(p, size);
+    for (uint32_t i = 0; i < size; i++)
+        p->digits[i] = rng();
+    p->digits[size - 1] |= 1;
+    p->size = size;
+    p->sign = 0;
+}
+
+/* Average cost of one @op over as many calls as fit in MIN_RUN_NS, where
+ * @size is n for FIB and the digits of each operand otherwise.
+ */
+static struct sample run(enum op op, uint64_t size)
+{
+    bn_t u = BN_INITIALIZER, v = BN_INITIALIZER, w = BN_INITIALIZER;
+    struct {
+        uint64_t nr, cycles, instructions;
+    } counts = {0};
+    long long start, t;
+    long calls = 0;
+
+    if (op != FIB) {
+        bn_random(u, size);
+        bn_random(v, size);
+    }
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+    start = now_ns();
+    do {
+        switch (op) {
+        case FIB:
+            fib_bignum(size, w, NULL);
+            break;
+        case MUL:
+            bn_mul(u, v, w);
+            break;
+        default:
+            bn_sqr(u, w);
+            break;
+        }
+        calls++;
+        t = now_ns() - start;
+    } while (t < MIN_RUN_NS);
+
+    struct sample s = {(double) t / calls, -1, -1};
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(perf_fd, &counts, sizeof(counts)) == sizeof(counts)) {
+            s.cycles = (double) counts.cycles / calls;
+            s.instructions = (double) counts.instructions / calls;
+        }
+    }
+    bn_free(u);
+    bn_free(v);
+    bn_free(w);
+    return s;
+}
+
+static void print(enum op op, uint64_t size, struct sample s)
+{
+    printf("%-10s %10llu %14.0f", op_names[op], (unsigned long long) size,
+           s.ns);
+    if (s.cycles < 0)
+        printf(" %14s %14s %6s\n", "-", "-", "-");
+    else
+        printf(" %14.0f %14.0f %6.2f\n", s.cycles, s.instructions,
+               s.instructions / s.cycles);
+}
+
+/* fib_batch_fn checking each F(k) against that of fib_bignum() in @arg. */
+static int batch_check(void *arg, uint64_t k, const bn *fib)
+{
+    const bn *want = ((bn_t *) arg)[k / BATCH_STEP - 1];
+
+    if (fib->size != want->size ||
+        memcmp(fib->digits, want->digits, sizeof(uint64_t) * fib->size)) {
+        fprintf(stderr, "fib_batch: wrong F(%llu)\n", (unsigned long long) k);
+        exit(1);
+    }
+    return 0;
+}
+
+static void batch(void)
+{
+    static bn_t want[BATCH_COUNT];
+    uint64_t ks[BATCH_COUNT];
+    long long t0, t1, t2;
+
+    for (int i = 0; i < BATCH_COUNT; i++) {
+        ks[i] = (uint64_t) BATCH_STEP * (i + 1);
+        bn_init(want[i]);
+    }
+    t0 = now_ns();
+    for (int i = 0; i < BATCH_COUNT; i++)
+        fib_bignum(ks[i], want[i], NULL);
+    t1 = now_ns();
+    if (fib_batch(ks, BATCH_COUNT, batch_check, want)) {
+        fprintf(stderr, "fib_batch: out of memory\n");
+        exit(1);
+    }
+    t2 = now_ns();
+
+    printf("F(%d*i) for i = 1..%d: fib_batch %lld ns, fib_bignum %lld ns "
+           "(%.2fx)\n",
+           BATCH_STEP, BATCH_COUNT, t2 - t1, t1 - t0,
+           (double) (t1 - t0) / (t2 - t1));
+    for (int i = 0; i < BATCH_COUNT; i++)
+        bn_free(want[i]);
+}
+
+int main(void)
+{
+    const uint64_t ns[] = {1000, 10000, 100000, 1000000, 10000000};
+    const uint64_t sizes[] = {16, 64, 256, 1024, 4096, 16384, 65536};
+
+    perf_open();
+    printf("%s digit loops, perf counters %s\n",
+           bn_cpu_init(true) ? "ADX" : "generic",
+           perf_fd >= 0 ? "on" : "unavailable");
+    printf("%-10s %10s %14s %14s %14s %6s\n", "op", "n/digits", "ns",
+           "cycles", "instructions", "ipc");
+    for (size_t i = 0; i < sizeof(ns) / sizeof(ns[0]); i++)
+        print(FIB, ns[i], run(FIB, ns[i]));
+    for (enum op op = MUL; op <= SQR; op++) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+            print(op, sizes[i], run(op, sizes[i]));
+    }
+    batch();
+    bn_cpu_exit();
+    return 0;
+}
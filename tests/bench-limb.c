@@ -0,0 +1,117 @@
+/* Time the limb loops of apm.h in C and, where the CPU has them, with the
+ * ADX kernels, alone and inside whole products.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "apm.h"
+
+#define MIN_RUN_NS 20000000LL /* per loop and size */
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+enum loop { ADD_N, SUB_N, DMUL, DMUL_ADD, SQR_DIAG, MUL_N, SQR, LOOPS };
+
+static const char *const loop_names[LOOPS] = {
+    "add_n", "sub_n", "dmul", "dmul_add", "sqr_diag", "mul_n", "sqr",
+};
+
+/* Average time of one call of @loop on size-digit operands, over as many
+ * calls as fit in MIN_RUN_NS.
+ */
+static double run(enum loop loop,
+                  const uint64_t *u,
+                  const uint64_t *v,
+                  uint32_t size,
+                  uint64_t *w,
+                  uint64_t *scratch)
+{
+    long long start = now_ns(), t;
+    long calls = 0;
+    do {
+        for (int i = 0; i < 16; i++) {
+            switch (loop) {
+            case ADD_N:
+                add_n(u, v, size, w);
+                break;
+            case SUB_N:
+                sub_n(u, v, size, w);
+                break;
+            case DMUL:
+                dmul(u, size, v[0], w);
+                break;
+            case DMUL_ADD:
+                dmul_add(u, size, v[0], w);
+                break;
+            case SQR_DIAG:
+                sqr_diag(u, size, w);
+                break;
+            case MUL_N:
+                mul_n(u, v, size, w, scratch);
+                break;
+            default:
+                _sqr(u, size, w, scratch);
+                break;
+            }
+        }
+        calls += 16;
+        t = now_ns() - start;
+    } while (t < MIN_RUN_NS);
+    return (double) t / calls;
+}
+
+int main(void)
+{
+    const uint32_t sizes[] = {8, 32, 128, 512, 2048};
+    const uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+    const int variants = apm_init(true) ? 2 : 1;
+
+    printf("%-10s %8s %12s %12s %8s\n", "loop", "digits", "c_ns", "adx_ns",
+           "speedup");
+    for (enum loop loop = 0; loop < LOOPS; loop++) {
+        for (uint32_t i = 0; i < n; i++) {
+            const uint32_t size = sizes[i];
+            uint64_t *u = enew(size), *v = enew(size);
+            uint64_t *w = new0(size * 2);
+            uint64_t *scratch = enew(mul_n_itch(size) + 1);
+            for (uint32_t j = 0; j < size; j++) {
+                u[j] = rng();
+                v[j] = rng();
+            }
+
+            double t[2];
+            for (int adx = 0; adx < variants; adx++) {
+                apm_adx = adx;
+                t[adx] = run(loop, u, v, size, w, scratch);
+            }
+            if (variants == 2)
+                printf("%-10s %8u %12.1f %12.1f %8.2f\n", loop_names[loop],
+                       size, t[0], t[1], t[0] / t[1]);
+            else
+                printf("%-10s %8u %12.1f %12s %8s\n", loop_names[loop], size,
+                       t[0], "-", "-");
+
+            FREE(u);
+            FREE(v);
+            FREE(w);
+            FREE(scratch);
+        }
+    }
+    return 0;
+}
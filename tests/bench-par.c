@@ -0,0 +1,75 @@
+/* Time fib_bignum() with the parallel split off and at several values of
+ * parallel_threshold, its tasks running on APM_THREADS worker threads in
+ * place of the module's workqueue, to see whether and from which size the
+ * split pays off on this machine before turning it on in the module.
+ *
+ * Usage: bench-par [n ...], F(10^6) and F(10^7) by default.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bn.c"
+#include "fib.c"
+
+#define RUNS 3 /* best of */
+
+static const uint32_t thresholds[] = {0, 1000, 2000, 4000, 8000, 16000};
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long time_fib(uint64_t n)
+{
+    long long best = 0;
+
+    for (int r = 0; r < RUNS; r++) {
+        bn_t fib = BN_INITIALIZER;
+        long long start = now_ns();
+        fib_bignum(n, fib, NULL);
+        long long ns = now_ns() - start;
+        bn_free(fib);
+        if (!r || ns < best)
+            best = ns;
+    }
+    return best;
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t defaults[] = {1000000, 10000000};
+    const int count = argc > 1 ? argc - 1 : 2;
+
+    printf("%s digit loops, %ld CPUs, %d workers\n",
+           bn_cpu_init(true) ? "ADX" : "generic",
+           sysconf(_SC_NPROCESSORS_ONLN), APM_THREADS);
+    for (int i = 0; i < count; i++) {
+        const uint64_t n = argc > 1 ? strtoull(argv[i + 1], NULL, 0)
+                                    : defaults[i];
+        long long serial = 0;
+
+        printf("F(%llu), %u digits:\n", (unsigned long long) n,
+               fib_digits(n));
+        for (size_t j = 0; j < sizeof(thresholds) / sizeof(*thresholds);
+             j++) {
+            apm_par_threshold = thresholds[j];
+            long long ns = time_fib(n);
+            if (!j) {
+                serial = ns;
+                printf("  %-22s %12lld ns\n", "serial", ns);
+                continue;
+            }
+            printf("  parallel_threshold=%-5u %9lld ns (%.2fx)\n",
+                   thresholds[j], ns, (double) serial / ns);
+        }
+    }
+    printf("%lu tasks run by workers, %lu taken back by their joiners\n",
+           apm_par_ran, apm_par_taken);
+    bn_cpu_exit();
+    return 0;
+}
@@ -0,0 +1,719 @@
+/* Differential test of the arithmetic of apm.h and bn.c against a
+ * schoolbook reference on 32-bit limbs, which shares no code with them:
+ * mul(), sqr(), add(), sub(), lshift() and lshifti() on digits, then
+ * bn_add() with mixed signs, bn_lshift(), bn_mul() and bn_sqr(), each also
+ * with the result in place of an operand, and bn_to_dec_str() against
+ * repeated division by 10^19.
+ *
+ * Operands are random, all ones (longest carry chains), sparse, or runs of
+ * ones and zeros, with odd sizes, top digits cleared and unbalanced product
+ * splits, at sizes around every threshold. Decimal conversions are checked
+ * at sizes around each level of their recursion and at powers of ten next to
+ * the powers 10^(19 * 2^i) it divides by. Products too large for the
+ * reference are checked modulo a few large numbers, and squares against
+ * products of distinct copies, which take other paths. Everything runs
+ * twice: with the thresholds of the build and with every tier and the
+ * parallel split reached from small sizes, whose tasks run on worker
+ * threads when built with APM_THREADS.
+ *
+ * Usage: fuzz-bn [seed [rounds]], where rounds counts the random cases of
+ * each pass on top of the fixed sizes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bn.c"
+
+/* Products with usize * vsize up to this are checked against ref_mul(). */
+#define REF_MAX_WORK (1U << 22)
+/* Unbalanced products of the fixed sizes stop there, where they take
+ * seconds below the NTT thresholds.
+ */
+#define MAX_UNBALANCED 30000
+/* Sizes of the random cases go up to 2^RANDOM_BITS digits, and those of
+ * decimal conversions, whose reference is quadratic, to 2^RANDOM_DEC_BITS.
+ */
+#define RANDOM_BITS 14
+#define RANDOM_DEC_BITS 10
+/* Decimal conversions are checked up to 2^MAX_DEC_LEVEL digits, and at
+ * powers of ten up to 10^(19 * 2^MAX_DEC_LEVEL).
+ */
+#define MAX_DEC_LEVEL 11
+
+#define REF_DEC_BASE 10000000000000000000ULL /* 10^19 */
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Reference arithmetic on magnitudes of n 32-bit limbs, least significant
+ * first. The results have room for every carry, so nothing is returned.
+ */
+static uint32_t *ref_from(const uint64_t *u, uint32_t size)
+{
+    uint32_t *r = malloc((size * 2 + 1) * sizeof(*r));
+
+    for (uint32_t i = 0; i < size; i++) {
+        r[i * 2] = (uint32_t) u[i];
+        r[i * 2 + 1] = (uint32_t) (u[i] >> 32);
+    }
+    return r;
+}
+
+static int ref_cmp(const uint32_t *u,
+                   uint32_t un,
+                   const uint32_t *v,
+                   uint32_t vn)
+{
+    while (un && !u[un - 1])
+        un--;
+    while (vn && !v[vn - 1])
+        vn--;
+    if (un != vn)
+        return un < vn ? -1 : 1;
+    while (un--) {
+        if (u[un] != v[un])
+            return u[un] < v[un] ? -1 : 1;
+    }
+    return 0;
+}
+
+/* w[un + 1] = u[un] + v[vn], un >= vn */
+static void ref_add(const uint32_t *u,
+                    uint32_t un,
+                    const uint32_t *v,
+                    uint32_t vn,
+                    uint32_t *w)
+{
+    uint64_t t = 0;
+
+    for (uint32_t i = 0; i < un; i++) {
+        t += (uint64_t) u[i] + (i < vn ? v[i] : 0);
+        w[i] = (uint32_t) t;
+        t >>= 32;
+    }
+    w[un] = (uint32_t) t;
+}
+
+/* w[un] = u[un] - v[vn], u >= v */
+static void ref_sub(const uint32_t *u,
+                    uint32_t un,
+                    const uint32_t *v,
+                    uint32_t vn,
+                    uint32_t *w)
+{
+    uint64_t borrow = 0;
+
+    for (uint32_t i = 0; i < un; i++) {
+        const uint64_t s = (uint64_t) (i < vn ? v[i] : 0) + borrow;
+        w[i] = (uint32_t) (u[i] - s);
+        borrow = u[i] < s;
+    }
+}
+
+/* w[un + vn] = u[un] * v[vn] */
+static void ref_mul(const uint32_t *u,
+                    uint32_t un,
+                    const uint32_t *v,
+                    uint32_t vn,
+                    uint32_t *w)
+{
+    memset(w, 0, (un + vn) * sizeof(*w));
+    for (uint32_t i = 0; i < un; i++) {
+        uint64_t t = 0;
+        for (uint32_t j = 0; j < vn; j++) {
+            t += (uint64_t) u[i] * v[j] + w[i + j];
+            w[i + j] = (uint32_t) t;
+            t >>= 32;
+        }
+        w[i + vn] = (uint32_t) t;
+    }
+}
+
+/* w[un + shift / 32 + 1] = u[un] << shift */
+static void ref_shl(const uint32_t *u,
+                    uint32_t un,
+                    unsigned int shift,
+                    uint32_t *w)
+{
+    const uint32_t limbs = shift / 32;
+    uint64_t t = 0;
+
+    memset(w, 0, limbs * sizeof(*w));
+    for (uint32_t i = 0; i < un; i++) {
+        t |= (uint64_t) u[i] << (shift % 32);
+        w[limbs + i] = (uint32_t) t;
+        t >>= 32;
+    }
+    w[limbs + un] = (uint32_t) t;
+}
+
+/* u[un] *= m in place, where u has room for the carry; return the new un. */
+static uint32_t ref_muli(uint32_t *u, uint32_t un, uint32_t m)
+{
+    uint64_t t = 0;
+
+    for (uint32_t i = 0; i < un; i++) {
+        t += (uint64_t) u[i] * m;
+        u[i] = (uint32_t) t;
+        t >>= 32;
+    }
+    if (t)
+        u[un++] = (uint32_t) t;
+    return un;
+}
+
+/* Decimal string of @sign and u[un], by schoolbook division by 10^19. */
+static char *ref_dec(const uint32_t *u, uint32_t un, bool sign)
+{
+    const size_t width = (un * 32 / 63 + 1) * 19;
+    uint32_t *t = malloc((un + 1) * sizeof(*t));
+    char *out = malloc(width + 2), *p = out + width + 1;
+
+    memcpy(t, u, un * sizeof(*t));
+    *p = '\0';
+    while (un && !t[un - 1])
+        un--;
+    while (un) {
+        unsigned __int128 r = 0;
+        for (uint32_t i = un; i--;) {
+            r = r << 32 | t[i];
+            t[i] = (uint32_t) (r / REF_DEC_BASE);
+            r %= REF_DEC_BASE;
+        }
+        for (int j = 0; j < 19; j++) {
+            *--p = '0' + r % 10;
+            r /= 10;
+        }
+        while (un && !t[un - 1])
+            un--;
+    }
+    while (*p == '0')
+        p++;
+    if (!*p)
+        *--p = '0';
+    else if (sign)
+        *--p = '-';
+    memmove(out, p, strlen(p) + 1);
+    free(t);
+    return out;
+}
+
+/* Whether got[size] and want[wn] are the same number. */
+static bool same(const uint64_t *got,
+                 uint32_t size,
+                 const uint32_t *want,
+                 uint32_t wn)
+{
+    for (uint32_t i = 0; i < max(size * 2, wn); i++) {
+        const uint32_t g =
+            i < size * 2 ? (uint32_t) (got[i / 2] >> (i % 2 * 32)) : 0;
+        if (g != (i < wn ? want[i] : 0))
+            return false;
+    }
+    return true;
+}
+
+/* u[size] modulo @m, for the products too large for ref_mul(). */
+static uint64_t residue(const uint64_t *u, uint32_t size, uint64_t m)
+{
+    uint64_t r = 0;
+
+    while (size--)
+        r = (((unsigned __int128) r << 64) | u[size]) % m;
+    return r;
+}
+
+static const uint64_t moduli[] = {
+    0xffffffffffffffc5ULL, /* 2^64 - 59 */
+    0x1fffffffffffffffULL, /* 2^61 - 1 */
+};
+
+static uint64_t seed;
+static int failures;
+
+static void fail(const char *what, uint32_t usize, uint32_t vsize)
+{
+    printf("FAIL %s %u x %u\n", what, usize, vsize);
+    failures++;
+}
+
+enum fill { FILL_RANDOM, FILL_ONES, FILL_SPARSE, FILL_RUNS, FILLS };
+
+/* Random digits, all bits set, mostly zero digits, or runs of set and clear
+ * bits up to a few digits long, which make long carries and borrows.
+ */
+static void fill(uint64_t *u, uint32_t size, enum fill how)
+{
+    uint64_t run = 0;
+    int left = 0;
+
+    for (uint32_t i = 0; i < size; i++) {
+        switch (how) {
+        case FILL_RANDOM:
+            u[i] = rng();
+            break;
+        case FILL_ONES:
+            u[i] = ~0ULL;
+            break;
+        case FILL_SPARSE:
+            u[i] = (rng() & 7) ? 0 : rng();
+            break;
+        default:
+            u[i] = 0;
+            for (unsigned int bit = 0; bit < DIGIT_BITS; bit++) {
+                if (!left--) {
+                    run = ~run;
+                    left = rng() % 256;
+                }
+                u[i] |= (run & 1) << bit;
+            }
+            break;
+        }
+    }
+    u[size - 1] |= 1ULL << 63;
+}
+
+/* New operand of @size digits, whose top digits are sometimes zero. */
+static uint64_t *operand(uint32_t size, enum fill how)
+{
+    uint64_t *u = enew(size);
+
+    fill(u, size, how);
+    if (!(rng() % 8))
+        zero(u + size - min(size, 3U), min(size, 3U));
+    return u;
+}
+
+static void check_product(const uint64_t *u,
+                          uint32_t usize,
+                          const uint64_t *v,
+                          uint32_t vsize,
+                          const uint64_t *w,
+                          const char *what)
+{
+    if ((uint64_t) usize * vsize <= REF_MAX_WORK) {
+        uint32_t *ru = ref_from(u, usize), *rv = ref_from(v, vsize);
+        uint32_t *rw = malloc((usize + vsize) * 2 * sizeof(*rw));
+        ref_mul(ru, usize * 2, rv, vsize * 2, rw);
+        if (!same(w, usize + vsize, rw, (usize + vsize) * 2))
+            fail(what, usize, vsize);
+        free(ru);
+        free(rv);
+        free(rw);
+        return;
+    }
+
+    for (size_t i = 0; i < sizeof(moduli) / sizeof(moduli[0]); i++) {
+        const uint64_t m = moduli[i];
+        const unsigned __int128 p =
+            (unsigned __int128) residue(u, usize, m) * residue(v, vsize, m);
+        if (residue(w, usize + vsize, m) != (uint64_t) (p % m)) {
+            fail(what, usize, vsize);
+            return;
+        }
+    }
+}
+
+/* mul() in both operand orders, and for equal sizes sqr() against the
+ * product of two copies.
+ */
+static void check_mul(uint32_t usize, uint32_t vsize, enum fill how)
+{
+    uint64_t *u = operand(usize, how), *v = operand(vsize, how);
+    uint64_t *w = enew(usize + vsize), *x = enew(usize + vsize);
+
+    mul(u, usize, v, vsize, w);
+    check_product(u, usize, v, vsize, w, "mul");
+    mul(v, vsize, u, usize, x);
+    if (memcmp(w, x, (usize + vsize) * DIGIT_SIZE))
+        fail("mul commuted", vsize, usize);
+
+    if (usize == vsize) {
+        copy(u, usize, v);
+        mul(u, usize, v, usize, w);
+        sqr(u, usize, x);
+        if (memcmp(w, x, usize * 2 * DIGIT_SIZE))
+            fail("sqr vs mul", usize, usize);
+        else if ((uint64_t) usize * usize <= REF_MAX_WORK)
+            check_product(u, usize, u, usize, x, "sqr");
+    }
+
+    FREE(u);
+    FREE(v);
+    FREE(w);
+    FREE(x);
+}
+
+/* add(), sub() with u >= v, lshift() and lshifti(). */
+static void check_add(uint32_t usize, uint32_t vsize, enum fill how)
+{
+    uint64_t *u = operand(usize, how), *v = operand(vsize, how);
+    const uint32_t n = max(usize, vsize);
+    uint64_t *w = enew(n + 1);
+    uint32_t *rw = malloc((n * 2 + 3) * sizeof(*rw));
+
+    /* Equal numbers now and then, for a zero difference. */
+    if (usize == vsize && !(rng() % 4))
+        copy(u, usize, v);
+    if (usize < vsize ||
+        (usize == vsize && cmp_n(u, v, usize) < 0)) {
+        SWAP(u, v);
+        SWAP(usize, vsize);
+    }
+    /* U >= V for sub(), even with the top digits of U cleared. */
+    u[usize - 1] |= usize > vsize;
+    uint32_t *ru = ref_from(u, usize), *rv = ref_from(v, vsize);
+
+    w[usize] = add(v, vsize, u, usize, w);
+    ref_add(ru, usize * 2, rv, vsize * 2, rw);
+    if (!same(w, usize + 1, rw, usize * 2 + 1))
+        fail("add", vsize, usize);
+
+    if (sub(u, usize, v, vsize, w))
+        fail("sub borrow", usize, vsize);
+    ref_sub(ru, usize * 2, rv, vsize * 2, rw);
+    if (!same(w, usize, rw, usize * 2))
+        fail("sub", usize, vsize);
+
+    const unsigned int shift = rng() % DIGIT_BITS;
+    rw[usize * 2 + 1] = 0;
+    ref_shl(ru, usize * 2, shift, rw);
+    w[usize] = lshift(u, usize, shift, w);
+    if (!same(w, usize + 1, rw, usize * 2 + 2))
+        fail("lshift", usize, shift);
+    const uint64_t cy = lshifti(u, usize, shift);
+    if (!same(u, usize, rw, usize * 2) ||
+        cy != (rw[usize * 2] | (uint64_t) rw[usize * 2 + 1] << 32))
+        fail("lshifti", usize, shift);
+
+    FREE(u);
+    FREE(v);
+    FREE(w);
+    free(ru);
+    free(rv);
+    free(rw);
+}
+
+/* A bn and its reference: sign and magnitude of n limbs. */
+struct num {
+    bn_t bn;
+    uint32_t *r;
+    uint32_t n;
+    bool sign;
+};
+
+static void num_new(struct num *a, uint32_t size, enum fill how)
+{
+    uint64_t *u = operand(size, how);
+
+    memset(a->bn, 0, sizeof(a->bn));
+    bn_reserve(a->bn, size);
+    copy(u, size, a->bn->digits);
+    a->bn->size = rsize(u, size);
+    a->sign = a->bn->size && (rng() & 1);
+    a->bn->sign = a->sign;
+    a->r = ref_from(u, size);
+    a->n = size * 2;
+    FREE(u);
+}
+
+static void num_free(struct num *a)
+{
+    bn_free(a->bn);
+    free(a->r);
+}
+
+/* Whether @p is want[wn] with @sign, in the form bn.c keeps numbers: no
+ * leading zero digits, and zero positive.
+ */
+static bool bn_same(const bn *p, const uint32_t *want, uint32_t wn, bool sign)
+{
+    if (p->size && !p->digits[p->size - 1])
+        return false;
+    if (!p->size)
+        return !p->sign && !ref_cmp(want, wn, want, 0);
+    return p->sign == sign && same(p->digits, p->size, want, wn);
+}
+
+/* The reference sum of @a and @b, into rw[max(a->n, b->n) + 1]. */
+static bool ref_sum(const struct num *a, const struct num *b, uint32_t *rw)
+{
+    const struct num *big = a, *small = b;
+    if (ref_cmp(a->r, a->n, b->r, b->n) < 0)
+        SWAP(big, small);
+
+    const uint32_t n = max(a->n, b->n);
+    uint32_t *rbig = calloc(n, sizeof(*rbig));
+    memcpy(rbig, big->r, big->n * sizeof(*rbig));
+    if (a->sign == b->sign) {
+        ref_add(rbig, n, small->r, small->n, rw);
+    } else {
+        ref_sub(rbig, n, small->r, small->n, rw);
+        rw[n] = 0;
+    }
+    free(rbig);
+    return big->sign;
+}
+
+/* Copy of @a in a fresh bn, for the in-place forms. */
+static void bn_dup(bn *p, const struct num *a)
+{
+    memset(p, 0, sizeof(*p));
+    bn_set(p, a->bn);
+}
+
+static void check_bn(uint32_t usize, uint32_t vsize, enum fill how)
+{
+    struct num a, b;
+    bn_t c = BN_INITIALIZER, d = BN_INITIALIZER;
+    const uint32_t n = max(usize, vsize) * 2;
+    /* Room for a * a and a shifted by up to 3 digits, the largest. */
+    uint32_t *rw = malloc((n * 2 + 8) * sizeof(*rw));
+
+    num_new(&a, usize, how);
+    num_new(&b, vsize, how);
+    /* Opposite numbers now and then, for a zero sum. */
+    if (usize == vsize && !(rng() % 4)) {
+        memcpy(b.r, a.r, a.n * sizeof(*a.r));
+        bn_set(b.bn, a.bn);
+        b.sign = a.bn->size && !a.sign;
+        b.bn->sign = b.sign;
+    }
+
+    bool sign = ref_sum(&a, &b, rw);
+    bn_add(a.bn, b.bn, c);
+    if (!bn_same(c, rw, n + 1, sign))
+        fail("bn_add", usize, vsize);
+    bn_dup(d, &a);
+    bn_add(d, b.bn, d);
+    if (!bn_same(d, rw, n + 1, sign))
+        fail("bn_add in a", usize, vsize);
+    bn_free(d);
+    bn_dup(d, &b);
+    bn_add(a.bn, d, d);
+    if (!bn_same(d, rw, n + 1, sign))
+        fail("bn_add in b", usize, vsize);
+    bn_free(d);
+
+    ref_shl(a.r, a.n, 1, rw);
+    bn_add(a.bn, a.bn, c);
+    if (!bn_same(c, rw, a.n + 1, a.sign))
+        fail("bn_add a + a", usize, usize);
+    bn_dup(d, &a);
+    bn_add(d, d, d);
+    if (!bn_same(d, rw, a.n + 1, a.sign))
+        fail("bn_add in a + a", usize, usize);
+    bn_free(d);
+
+    const unsigned int bits = rng() % (DIGIT_BITS * 3);
+    ref_shl(a.r, a.n, bits, rw);
+    bn_lshift(a.bn, bits, c);
+    if (!bn_same(c, rw, a.n + bits / 32 + 1, a.sign))
+        fail("bn_lshift", usize, bits);
+    bn_dup(d, &a);
+    bn_lshift(d, bits, d);
+    if (!bn_same(d, rw, a.n + bits / 32 + 1, a.sign))
+        fail("bn_lshift in place", usize, bits);
+    bn_free(d);
+
+    if ((uint64_t) usize * vsize <= REF_MAX_WORK) {
+        ref_mul(a.r, a.n, b.r, b.n, rw);
+        sign = a.sign ^ b.sign;
+        bn_mul(a.bn, b.bn, c);
+        if (!bn_same(c, rw, a.n + b.n, sign))
+            fail("bn_mul", usize, vsize);
+        bn_dup(d, &a);
+        bn_mul(d, b.bn, d);
+        if (!bn_same(d, rw, a.n + b.n, sign))
+            fail("bn_mul in a", usize, vsize);
+        bn_free(d);
+    }
+    if ((uint64_t) usize * usize <= REF_MAX_WORK) {
+        ref_mul(a.r, a.n, a.r, a.n, rw);
+        bn_sqr(a.bn, c);
+        if (!bn_same(c, rw, a.n * 2, false))
+            fail("bn_sqr", usize, usize);
+        bn_dup(d, &a);
+        bn_sqr(d, d);
+        if (!bn_same(d, rw, a.n * 2, false))
+            fail("bn_sqr in place", usize, usize);
+        bn_free(d);
+    }
+
+    num_free(&a);
+    num_free(&b);
+    bn_free(c);
+    free(rw);
+}
+
+static void check_dec_str(const bn *p, const uint32_t *r, uint32_t n, bool sign)
+{
+    char *got = bn_to_dec_str(p), *want = ref_dec(r, n, sign);
+
+    if (!got || strcmp(got, want))
+        fail("bn_to_dec_str", p->size, 0);
+    FREE(got);
+    free(want);
+}
+
+/* bn_to_dec_str() of a signed number of @size digits. */
+static void check_dec(uint32_t size, enum fill how)
+{
+    struct num a;
+
+    num_new(&a, size, how);
+    check_dec_str(a.bn, a.r, a.n, a.sign);
+    num_free(&a);
+}
+
+/* bn_to_dec_str() of 10^e and 10^e - 1, built on the reference limbs. */
+static void check_dec_pow(uint32_t e)
+{
+    const uint32_t limbs = e / 9 + 2; /* 10^9 < 2^32 */
+    uint32_t *r = calloc(limbs, sizeof(*r));
+    uint32_t n = 1;
+    bn_t p = BN_INITIALIZER;
+
+    r[0] = 1;
+    for (uint32_t i = 0; i < e / 9; i++)
+        n = ref_muli(r, n, 1000000000);
+    for (uint32_t i = 0; i < e % 9; i++)
+        n = ref_muli(r, n, 10);
+
+    for (int minus_one = 0; minus_one < 2; minus_one++) {
+        if (minus_one) {
+            const uint32_t one = 1;
+            ref_sub(r, n, &one, 1, r);
+        }
+        bn_reserve(p, n / 2 + 1);
+        for (uint32_t i = 0; i < n / 2 + 1; i++) {
+            p->digits[i] = i * 2 < n ? r[i * 2] : 0;
+            if (i * 2 + 1 < n)
+                p->digits[i] |= (uint64_t) r[i * 2 + 1] << 32;
+        }
+        p->size = rsize(p->digits, n / 2 + 1);
+        p->sign = 0;
+        check_dec_str(p, r, n, false);
+    }
+    bn_free(p);
+    free(r);
+}
+
+/* Sizes around every threshold with unbalanced splits of mul() on top,
+ * then @rounds random cases.
+ */
+static void fuzz(long rounds)
+{
+    const uint32_t sizes[] = {
+        1,
+        2,
+        3,
+        BASE_SQR_THRESHOLD,
+        BASE_SQR_THRESHOLD + 1,
+        KARATSUBA_MUL_THRESHOLD - 1,
+        KARATSUBA_MUL_THRESHOLD,
+        KARATSUBA_MUL_THRESHOLD * 2 + 1,
+        KARATSUBA_SQR_THRESHOLD,
+        KARATSUBA_SQR_THRESHOLD + 1,
+        TOOM3_MUL_THRESHOLD - 1,
+        TOOM3_MUL_THRESHOLD,
+        TOOM3_SQR_THRESHOLD,
+        TOOM3_SQR_THRESHOLD * 3 + 2,
+        NTT_MUL_THRESHOLD - 1,
+        NTT_MUL_THRESHOLD,
+        NTT_SQR_THRESHOLD - 1,
+        NTT_SQR_THRESHOLD,
+    };
+
+    for (enum fill how = 0; how < FILLS; how++) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            const uint32_t s = sizes[i];
+            check_mul(s, s, how);
+            check_mul(s + 7, s, how);
+            /* Whole pieces of V, and leftovers on either side of the
+             * Karatsuba threshold.
+             */
+            if (s * 3 <= MAX_UNBALANCED) {
+                check_mul(s * 3, s, how);
+                check_mul(s * 2 + KARATSUBA_MUL_THRESHOLD - 1, s, how);
+                check_mul(s * 2 + KARATSUBA_MUL_THRESHOLD, s, how);
+            }
+            check_add(s, s, how);
+            check_add(s + 1, s, how);
+            check_bn(s, s, how);
+            check_bn(s, rng() % s + 1, how);
+        }
+        /* Numbers of 63 * 2^level bits take the conversion one level up. */
+        for (uint32_t level = 0; level <= MAX_DEC_LEVEL; level++) {
+            const uint32_t s = (63U << level) / 64 + 1;
+            check_dec(s - (s > 1), how);
+            check_dec(s, how);
+            check_dec(s + 1, how);
+        }
+    }
+    for (uint32_t level = 0; level <= MAX_DEC_LEVEL; level++) {
+        const uint32_t e = 19U << level;
+        check_dec_pow(e - 1);
+        check_dec_pow(e);
+        check_dec_pow(e + 1);
+    }
+
+    for (long i = 0; i < rounds; i++) {
+        const uint32_t usize = rng() % (1U << (rng() % RANDOM_BITS)) + 1;
+        const uint32_t vsize = rng() % (1U << (rng() % RANDOM_BITS)) + 1;
+        const enum fill how = rng() % FILLS;
+        switch (rng() % 4) {
+        case 0:
+            check_mul(usize, vsize, how);
+            break;
+        case 1:
+            check_add(usize, vsize, how);
+            break;
+        case 2:
+            check_dec(rng() % (1U << (rng() % RANDOM_DEC_BITS)) + 1, how);
+            break;
+        default:
+            check_bn(usize, vsize, how);
+            break;
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    seed = argc > 1 ? strtoull(argv[1], NULL, 0) : rng_state;
+    const long rounds = argc > 2 ? strtol(argv[2], NULL, 0) : 1000;
+
+    rng_state = seed ? seed : 1;
+    printf("seed %llu, %s digit loops\n", (unsigned long long) seed,
+           bn_cpu_init(true) ? "ADX" : "generic");
+    fuzz(rounds);
+    /* Every tier and the parallel split from small sizes, as in
+     * tests/test-mul.c.
+     */
+    apm_tune.base_sqr = 3;
+    apm_tune.karatsuba_mul = 4;
+    apm_tune.karatsuba_sqr = 6;
+    apm_tune.toom3_mul = 12;
+    apm_tune.toom3_sqr = 15;
+    apm_tune.ntt_mul = 40;
+    apm_tune.ntt_sqr = 70;
+    apm_par_threshold = 100;
+    apm_tune_check();
+    fuzz(rounds);
+    bn_cpu_exit();
+
+    if (failures) {
+        printf("%d failures, seed %llu\n", failures, (unsigned long long) seed);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,298 @@
+/* Check the ADX limb kernels against the C loops, then the Toom-3 and NTT
+ * multiplication and squaring against the Karatsuba and schoolbook routines
+ * they replace, around and above every threshold.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apm.h"
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+enum fill { FILL_RANDOM, FILL_ONES, FILL_SPARSE, FILLS };
+
+/* Random digits, all bits set (largest coefficients), or mostly zero digits
+ * like the low half of a power of ten.
+ */
+static void fill(uint64_t *u, uint32_t size, enum fill how)
+{
+    for (uint32_t i = 0; i < size; i++) {
+        switch (how) {
+        case FILL_RANDOM:
+            u[i] = rng();
+            break;
+        case FILL_ONES:
+            u[i] = ~0ULL;
+            break;
+        default:
+            u[i] = (rng() & 7) ? 0 : rng();
+            break;
+        }
+    }
+    u[size - 1] |= 1ULL << 63;
+}
+
+static int failures;
+
+static void expect(const uint64_t *got,
+                   const uint64_t *want,
+                   uint32_t size,
+                   const char *what,
+                   uint32_t usize,
+                   uint32_t vsize)
+{
+    if (memcmp(got, want, size * DIGIT_SIZE)) {
+        printf("FAIL %s %u x %u\n", what, usize, vsize);
+        failures++;
+    }
+}
+
+static void check(uint32_t usize, uint32_t vsize, enum fill how)
+{
+    uint64_t *u = enew(usize), *v = enew(vsize);
+    uint64_t *want = enew(usize + vsize), *got = enew(usize + vsize);
+    /* Enough for toom3_*() called directly below its threshold too. */
+    const uint32_t n = max(usize, vsize);
+    const uint32_t toom3 = mul_n_itch(n) + TOOM3_PRODUCTS(n) + n * 2 + 2;
+    uint64_t *scratch = enew(max(ntt_mul_itch(usize + vsize), toom3));
+
+    fill(u, usize, how);
+    fill(v, vsize, how);
+
+    _mul_base(u, usize, v, vsize, want);
+    ntt_mul(u, usize, v, vsize, got, scratch);
+    expect(got, want, usize + vsize, "ntt_mul", usize, vsize);
+    mul(u, usize, v, vsize, got);
+    expect(got, want, usize + vsize, "mul", usize, vsize);
+
+    if (usize == vsize) {
+        if (usize >= 5) {
+            toom3_mul(u, v, usize, got, scratch);
+            expect(got, want, usize * 2, "toom3_mul", usize, vsize);
+        }
+        mul_n(u, v, usize, want, scratch);
+        ntt_mul(u, usize, v, vsize, got, scratch);
+        expect(got, want, usize * 2, "ntt_mul vs mul_n", usize, vsize);
+
+        sqr_n(u, usize, want, scratch);
+        if (usize >= 5) {
+            toom3_sqr(u, usize, got, scratch);
+            expect(got, want, usize * 2, "toom3_sqr vs sqr_n", usize, usize);
+        }
+        ntt_sqr(u, usize, got, scratch);
+        expect(got, want, usize * 2, "ntt_sqr vs sqr_n", usize, usize);
+        sqr(u, usize, got);
+        expect(got, want, usize * 2, "sqr", usize, usize);
+    }
+
+    FREE(u);
+    FREE(v);
+    FREE(want);
+    FREE(got);
+    FREE(scratch);
+}
+
+/* Run every limb loop on size digits with the C code and with the ADX
+ * kernels, which must agree on the digits and the carry.
+ */
+static void check_limbs(uint32_t size, enum fill how)
+{
+    uint64_t *u = enew(size + 1), *v = enew(size + 1);
+    uint64_t *w[2], *x[2], cy[2][4];
+
+    fill(u, size + 1, how);
+    fill(v, size + 1, how);
+    for (int adx = 0; adx < 2; adx++) {
+        uint64_t state = rng_state;
+        apm_adx = adx;
+        w[adx] = new0(size * 2 + 2);
+        x[adx] = enew(size * 2 + 2);
+        fill(x[adx], size * 2 + 2, how);
+        cy[adx][0] = add_n(u, v, size, w[adx]);
+        cy[adx][1] = sub_n(u, v, size, w[adx] + size);
+        cy[adx][2] = dmul(u, size, v[size], x[adx]);
+        cy[adx][3] = dmul_add(u, size, v[size] | 2, x[adx] + size);
+        sqr_diag(u, size, x[adx]);
+        /* Same digits for both runs. */
+        if (!adx)
+            rng_state = state;
+    }
+    if (memcmp(w[0], w[1], (size * 2 + 2) * DIGIT_SIZE) ||
+        memcmp(x[0], x[1], (size * 2 + 2) * DIGIT_SIZE) ||
+        memcmp(cy[0], cy[1], sizeof(cy[0]))) {
+        printf("FAIL limbs %u\n", size);
+        failures++;
+    }
+
+    FREE(u);
+    FREE(v);
+    for (int adx = 0; adx < 2; adx++) {
+        FREE(w[adx]);
+        FREE(x[adx]);
+    }
+}
+
+/* Check sizes around every threshold, then random ones. Sizes past
+ * MAX_CHECKED are left out, where the schoolbook reference gets slow.
+ */
+#define MAX_CHECKED 30000
+
+static void check_thresholds(void)
+{
+    const uint32_t sizes[] = {
+        1,
+        2,
+        BASE_SQR_THRESHOLD + 1,
+        KARATSUBA_MUL_THRESHOLD - 1,
+        KARATSUBA_MUL_THRESHOLD,
+        KARATSUBA_SQR_THRESHOLD + 1,
+        TOOM3_MUL_THRESHOLD - 1,
+        TOOM3_MUL_THRESHOLD,
+        TOOM3_SQR_THRESHOLD + 1,
+        TOOM3_SQR_THRESHOLD * 3 + 2,
+        NTT_MUL_THRESHOLD - 1,
+        NTT_MUL_THRESHOLD,
+        NTT_SQR_THRESHOLD - 1,
+        NTT_SQR_THRESHOLD,
+        4099,
+        MAX_CHECKED - 7, /* NTT coefficients below 24 bits */
+    };
+    const uint32_t n = sizeof(sizes) / sizeof(sizes[0]);
+
+    for (enum fill how = 0; how < FILLS; how++) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (sizes[i] + 7 > MAX_CHECKED)
+                continue;
+            check(sizes[i], sizes[i], how);
+            check(sizes[i] + 7, sizes[i], how);
+            if (sizes[i] * 3 + 1 <= MAX_CHECKED)
+                check(sizes[i] * 3 + 1, sizes[i], how);
+        }
+    }
+    for (int i = 0; i < 100; i++) {
+        uint32_t usize = rng() % 3000 + 1, vsize = rng() % 3000 + 1;
+        check(usize, vsize, rng() % FILLS);
+    }
+}
+
+#ifdef APM_THREADS
+/* Several threads multiplying at once through the parallel split, whose
+ * tasks then queue up behind each other's on the shared workers, against
+ * products computed beforehand.
+ */
+#define CALLERS 4
+
+struct caller {
+    uint64_t *u, *v, *want, *got;
+    uint32_t usize, vsize;
+    bool bad;
+};
+
+static void *caller_run(void *arg)
+{
+    struct caller *c = arg;
+
+    for (int i = 0; i < 8; i++) {
+        if (c->u == c->v)
+            sqr(c->u, c->usize, c->got);
+        else
+            mul(c->u, c->usize, c->v, c->vsize, c->got);
+        if (memcmp(c->got, c->want, (c->usize + c->vsize) * DIGIT_SIZE))
+            c->bad = true;
+    }
+    return NULL;
+}
+
+static void check_concurrent(void)
+{
+    /* A square, balanced and short operands, and one split twice. */
+    const uint32_t usizes[CALLERS] = {1500, 1200, 2500, 4000};
+    const uint32_t vsizes[CALLERS] = {1500, 1100, 700, 3900};
+    struct caller c[CALLERS];
+    pthread_t threads[CALLERS];
+
+    for (int i = 0; i < CALLERS; i++) {
+        c[i].usize = usizes[i];
+        c[i].vsize = vsizes[i];
+        c[i].u = enew(c[i].usize);
+        c[i].v = i ? enew(c[i].vsize) : c[i].u;
+        c[i].want = enew(c[i].usize + c[i].vsize);
+        c[i].got = enew(c[i].usize + c[i].vsize);
+        c[i].bad = false;
+        fill(c[i].u, c[i].usize, FILL_RANDOM);
+        if (i)
+            fill(c[i].v, c[i].vsize, FILL_RANDOM);
+        _mul_base(c[i].u, c[i].usize, c[i].v, c[i].vsize, c[i].want);
+    }
+    for (int i = 0; i < CALLERS; i++)
+        pthread_create(&threads[i], NULL, caller_run, &c[i]);
+    for (int i = 0; i < CALLERS; i++) {
+        pthread_join(threads[i], NULL);
+        if (c[i].bad) {
+            printf("FAIL concurrent %u x %u\n", c[i].usize, c[i].vsize);
+            failures++;
+        }
+        if (c[i].v != c[i].u)
+            FREE(c[i].v);
+        FREE(c[i].u);
+        FREE(c[i].want);
+        FREE(c[i].got);
+    }
+
+    printf("%lu tasks run by workers, %lu taken back by their joiners\n",
+           apm_par_ran, apm_par_taken);
+    if (!apm_par_ran) {
+        printf("FAIL no task ran on a worker\n");
+        failures++;
+    }
+}
+#endif
+
+int main(void)
+{
+    if (apm_init(true)) {
+        for (enum fill how = 0; how < FILLS; how++) {
+            for (uint32_t size = 1; size < 40; size++)
+                check_limbs(size, how);
+        }
+        apm_init(true);
+    } else {
+        printf("no ADX, checking the C loops only\n");
+    }
+
+    check_thresholds();
+    /* Again with every tier reached from small sizes, the way apm_tune can
+     * be set from outside, and with the parallel split above them, whose
+     * tasks run in turn here unless built with APM_THREADS.
+     */
+    apm_tune.base_sqr = 3;
+    apm_tune.karatsuba_mul = 4;
+    apm_tune.karatsuba_sqr = 6;
+    apm_tune.toom3_mul = 12;
+    apm_tune.toom3_sqr = 15;
+    apm_tune.ntt_mul = 40;
+    apm_tune.ntt_sqr = 70;
+    apm_par_threshold = 100;
+    apm_tune_check();
+    apm_par_init();
+    check_thresholds();
+#ifdef APM_THREADS
+    check_concurrent();
+#endif
+    apm_par_exit();
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+/* Find the size from which each multiplication and squaring algorithm of
+ * apm.h beats the one below it on this CPU, and print them as apm-tune.h,
+ * or with -p as module parameters. The timings go to stderr.
+ *
+ * Every tier is timed through _mul() or _sqr() with the thresholds found
+ * for the tiers below it: once with its own threshold out of reach, and
+ * once with it at the size, so that one level of the algorithm runs over
+ * the tuned lower tiers.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "apm.h"
+
+#define ROUNDS 3
+#define MIN_RUN_NS 4000000LL /* per round, to stay above the timer noise */
+#define CONFIRM 3 /* wins in a row that place a threshold */
+#define NEVER UINT32_MAX
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static long long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct tier {
+    const char *name;    /* of the apm-tune.h macro and the parameter */
+    uint32_t *threshold; /* in apm_tune */
+    bool sqr;            /* timed through _sqr() rather than _mul() */
+    bool at_most;        /* the lower algorithm runs up to the threshold */
+    uint32_t from, to;   /* sizes swept */
+};
+
+/* Average time of one product or square of size-digit operands over
+ * MIN_RUN_NS, with the thresholds as they are.
+ */
+static double run(const struct tier *tier,
+                  const uint64_t *u,
+                  const uint64_t *v,
+                  uint32_t size,
+                  uint64_t *w)
+{
+    const uint32_t n = tier->sqr ? sqr_itch(size) : mul_itch(size, size);
+    uint64_t *scratch = n ? enew(n) : NULL;
+    long long start = now_ns(), t;
+    long calls = 0;
+
+    do {
+        if (tier->sqr)
+            _sqr(u, size, w, scratch);
+        else
+            _mul(u, size, v, size, w, scratch);
+        calls++;
+        t = now_ns() - start;
+    } while (t < MIN_RUN_NS);
+    FREE(scratch);
+    return (double) t / calls;
+}
+
+/* Sweep the sizes of @tier and set its threshold to the first one from
+ * which the algorithm wins CONFIRM times in a row, or past the sweep if it
+ * never does.
+ */
+static void tune(const struct tier *tier)
+{
+    uint32_t cross = 0, wins = 0;
+
+    fprintf(stderr, "%s\n%8s %12s %12s\n", tier->name, "digits", "below",
+            "above");
+    for (uint32_t size = tier->from; size <= tier->to && wins < CONFIRM;
+         size += max(size / 16, 1U)) {
+        uint64_t *u = enew(size), *v = enew(size), *w = enew(size * 2);
+        for (uint32_t i = 0; i < size; i++) {
+            u[i] = rng();
+            v[i] = rng();
+        }
+
+        /* Best of ROUNDS each, taken in turns so that both see the same
+         * load on the machine.
+         */
+        double below = 0, above = 0;
+        for (int r = 0; r < ROUNDS; r++) {
+            *tier->threshold = NEVER;
+            const double b = run(tier, u, v, size, w);
+            *tier->threshold = tier->at_most ? size - 1 : size;
+            const double a = run(tier, u, v, size, w);
+            below = r ? min(below, b) : b;
+            above = r ? min(above, a) : a;
+        }
+        fprintf(stderr, "%8u %12.0f %12.0f\n", size, below, above);
+
+        if (above < below) {
+            if (!wins++)
+                cross = size;
+        } else {
+            wins = 0;
+        }
+
+        FREE(u);
+        FREE(v);
+        FREE(w);
+    }
+
+    if (wins < CONFIRM) {
+        fprintf(stderr, "%s: no crossover up to %u digits\n", tier->name,
+                tier->to);
+        cross = tier->to + 1;
+    }
+    *tier->threshold = tier->at_most ? cross - 1 : cross;
+}
+
+int main(int argc, char *argv[])
+{
+    struct tier tiers[] = {
+        {"BASE_SQR", &apm_tune.base_sqr, true, true, 2, 64},
+        {"KARATSUBA_MUL", &apm_tune.karatsuba_mul, false, false, 4, 256},
+        {"KARATSUBA_SQR", &apm_tune.karatsuba_sqr, true, false, 4, 256},
+        {"TOOM3_MUL", &apm_tune.toom3_mul, false, false, 32, 2048},
+        {"TOOM3_SQR", &apm_tune.toom3_sqr, true, false, 32, 2048},
+        {"NTT_MUL", &apm_tune.ntt_mul, false, false, 1024, 65536},
+        {"NTT_SQR", &apm_tune.ntt_sqr, true, false, 1024, 65536},
+    };
+    const int n = sizeof(tiers) / sizeof(tiers[0]);
+    const bool params = argc > 1 && !strcmp(argv[1], "-p");
+
+    apm_init(true);
+    /* Every tier starts out of reach, and is placed in turn. */
+    for (int i = 1; i < n; i++)
+        *tiers[i].threshold = NEVER;
+    for (int i = 0; i < n; i++) {
+        /* Below the tier under it, the algorithm would race the basecase. */
+        for (int j = 0; j < i; j++) {
+            if (tiers[j].sqr == tiers[i].sqr && !tiers[j].at_most)
+                tiers[i].from = max(tiers[i].from, *tiers[j].threshold);
+        }
+        tune(&tiers[i]);
+    }
+
+    if (!params)
+        printf("/* Generated by tests/tune, see apm.h. */\n");
+    for (int i = 0; i < n; i++) {
+        if (params) {
+            for (const char *c = tiers[i].name; *c; c++)
+                putchar(tolower((unsigned char) *c));
+            printf("_threshold=%u%c", *tiers[i].threshold,
+                   i == n - 1 ? '\n' : ' ');
+        } else {
+            printf("#define APM_TUNE_%s %u\n", tiers[i].name,
+                   *tiers[i].threshold);
+        }
+    }
+    return 0;
+}